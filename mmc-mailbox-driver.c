@@ -9,23 +9,186 @@
  */
 
 #include <linux/bitops.h>
+#include <linux/completion.h>
+#include <linux/crc32.h>
 #include <linux/delay.h>
+#include <linux/fs.h>
 #include <linux/gpio/consumer.h>
+#include <linux/hrtimer.h>
 #include <linux/i2c.h>
+#include <linux/idr.h>
 #include <linux/init.h>
+#include <linux/io_uring.h>
+#include <linux/interrupt.h>
 #include <linux/jiffies.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/panic_notifier.h>
+#include <linux/poll.h>
 #include <linux/property.h>
+#include <linux/rcupdate.h>
+#include <linux/rwsem.h>
+#include <linux/reboot.h>
 #include <linux/regmap.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include <linux/mod_devicetable.h>
 #include <linux/nvmem-provider.h>
 #include <linux/of_device.h>
 #include <linux/pm_runtime.h>
 
+#include "mmc-mailbox.h"
+
+/* For read/write accesses longer than 1 byte, set the "page lock" flag
+ * This flag prevents the MMC from swapping the page, protecting the critical section
+ */
+
+#define MB_LOCK_OFFS 2047
+#define MB_LOCK_FLAG 0x01
+
+#define MB_FPGA_STATUS_OFFS 2046
+#define MB_FPGA_STATUS_SHDN_FINISHED BIT(2)
+#define MB_FPGA_STATUS_REBOOTING BIT(3)
+#define MB_FPGA_STATUS_PANIC BIT(4)
+
+/* Requests from the MMC in the optional command byte ("desy,command-offset") */
+#define MB_MMC_CMD_SHUTDOWN BIT(0)
+
+/*
+ * The mailbox is split into regions according to who writes them.
+ * Host regions are only ever written by us, so once their content is known
+ * the RAM shadow is authoritative and reads never touch the bus.
+ * MMC regions are only written by the MMC; they are served from the shadow
+ * for max_age_ms after a complete refresh (0 disables caching).
+ * Shared regions and the control bytes are always read from the bus.
+ */
+enum mmc_mb_region_type {
+    MMC_MB_REGION_SHARED,
+    MMC_MB_REGION_HOST,
+    MMC_MB_REGION_MMC,
+    MMC_MB_REGION_CTRL,
+};
+
+struct mmc_mb_region_desc {
+    u32 start;
+    u32 len;
+    enum mmc_mb_region_type type;
+    u32 max_age_ms;
+};
+
+struct mmc_mb_region {
+    unsigned int start;
+    unsigned int end;
+    enum mmc_mb_region_type type;
+    unsigned int max_age_ms;
+    ktime_t stamp; /* last complete refresh from the bus, 0 if never */
+    bool gap;      /* not declared, only fills the space between regions */
+};
+
+#define MMC_MB_XFER_MAX_CHUNKS 16
+#define MMC_MB_XFER_MAX_MSGS (2 * MMC_MB_XFER_MAX_CHUNKS + 2)
+
+/* Message array for a combined transfer, see mmc_mb_xfer_run() */
+struct mmc_mb_xfer {
+    struct i2c_msg msgs[MMC_MB_XFER_MAX_MSGS];
+    unsigned int num;
+    bool locked;
+    u8* buf; /* DMA-safe space for addresses and write data */
+    unsigned int used;
+};
+
+/*
+ * Retry policies for NAKed transfers. "fixed" is the at24 behaviour of
+ * sleeping 1 ms between attempts; "exponential" starts at a backoff learned
+ * from previous retries and doubles it up to retry_max_us.
+ */
+enum mmc_mb_retry_policy {
+    MMC_MB_RETRY_EXPONENTIAL,
+    MMC_MB_RETRY_IMMEDIATE,
+    MMC_MB_RETRY_FIXED,
+    MMC_MB_RETRY_NONE,
+};
+
+static const char* const mmc_mb_retry_names[] = {
+    [MMC_MB_RETRY_EXPONENTIAL] = "exponential",
+    [MMC_MB_RETRY_IMMEDIATE] = "immediate",
+    [MMC_MB_RETRY_FIXED] = "fixed",
+    [MMC_MB_RETRY_NONE] = "none",
+};
+
+/* What to do when the MMC requests a shutdown */
+enum mmc_mb_cmd_policy {
+    MMC_MB_CMD_POWEROFF,
+    MMC_MB_CMD_UEVENT,
+    MMC_MB_CMD_IGNORE,
+};
+
+static const char* const mmc_mb_cmd_names[] = {
+    [MMC_MB_CMD_POWEROFF] = "poweroff",
+    [MMC_MB_CMD_UEVENT] = "uevent",
+    [MMC_MB_CMD_IGNORE] = "ignore",
+};
+
+struct mmc_mb_retry {
+    ktime_t start;
+    ktime_t deadline;
+    unsigned int attempts;
+    unsigned int delay_us;
+};
+
+/* A copy of the whole mailbox, published via RCU */
+struct mmc_mb_snapshot {
+    struct rcu_head rcu;
+    u64 version;
+    ktime_t stamp;
+    u8 data[];
+};
+
+/* A reader waiting for lock, see mmc_mb_read_merge() */
+struct mmc_mb_read_req {
+    struct list_head node;
+    unsigned int lo;
+    unsigned int hi;
+    ktime_t queued;
+};
+
+/* A completed bus read of [lo, hi) that started at stamp */
+struct mmc_mb_fill {
+    unsigned int lo;
+    unsigned int hi;
+    ktime_t stamp;
+};
+
+#define MMC_MB_FILL_HISTORY 8
+
+/* Lock hold time buckets: < 1 us, < 2 us, < 4 us, ... and everything above */
+#define MMC_MB_LOCK_HIST_BUCKETS 20
+
+/*
+ * Per open file of the character device, on the files list of its mailbox.
+ * watch and num_watch are protected by the mailbox lock.
+ */
+struct mmc_mb_file {
+    struct list_head node;
+    struct at24_data* mmc_mailbox;
+    int doorbell_seen;
+    struct mmc_mb_range watch[MMC_MB_WATCH_MAX_RANGES];
+    unsigned int num_watch;
+    bool changed;
+};
+
 struct at24_data {
     /*
    * Lock protects against activities from other Linux tasks,
@@ -33,14 +196,204 @@ struct at24_data {
    */
     struct mutex lock;
 
+    /*
+     * Chunk sizes, protected by lock: a single transfer may hold the bus for
+     * hold_budget_us, which is hold_max bytes at byte_ns per byte. read_max
+     * and write_max can be changed from sysfs within the adapter limits.
+     */
+    unsigned int read_max;
     unsigned int write_max;
+    unsigned int read_limit;
+    unsigned int write_limit;
+    unsigned int hold_max;
+    unsigned int hold_budget_us;
+    unsigned int byte_ns;
+
+    /* Retry policy and statistics, protected by lock */
+    enum mmc_mb_retry_policy retry_policy;
+    unsigned int timeout_ms;
+    unsigned int retry_min_us;
+    unsigned int retry_max_us;
+    unsigned int retry_learned_us;
+    u64 retry_transfers;
+    u64 retry_failures;
+    u64 retry_timeouts;
 
     u32 byte_len;
     u16 page_size;
+    bool ram_mode;
 
     struct nvmem_device* nvmem;
     struct i2c_client* client;
     struct regmap* regmap;
+
+    /*
+   * RAM shadow of the whole mailbox, protected by lock.
+   * shadow_known marks the host region bytes whose shadow content is valid;
+   * bus reads land in bounce (indexed by mailbox offset) before being merged.
+   */
+    u8* shadow;
+    u8* bounce;
+    unsigned long* shadow_known;
+
+    /*
+   * Write-back mode (writeback_ms != 0): writes to host regions only update
+   * the shadow and mark shadow_dirty, flush_work writes them back at most
+   * writeback_ms later.
+   */
+    unsigned long* shadow_dirty;
+    unsigned int writeback_ms;
+    struct delayed_work flush_work;
+
+    /* Probe fills the shadow in prefill_work; accesses wait for ready */
+    struct work_struct prefill_work;
+    struct completion ready;
+
+    /*
+   * Snapshot mode (snapshot_ms != 0): reads accept data up to snapshot_ms
+   * old from the RCU-protected snapshot without taking lock. It is replaced
+   * under lock after a refresh or a host write.
+   */
+    struct mmc_mb_snapshot __rcu* snapshot;
+    unsigned int snapshot_ms;
+    u64 snapshot_version;
+
+    /*
+   * Read merging: readers waiting for lock are queued on reads (protected
+   * by reads_lock), the last bus reads are kept in fills (protected by lock).
+   */
+    spinlock_t reads_lock;
+    struct list_head reads;
+    struct mmc_mb_fill fills[MMC_MB_FILL_HISTORY];
+    unsigned int fill_next;
+    u64 merged_reads;
+
+    /*
+   * Doorbell: an optional interrupt line the CPLD raises when the MMC has
+   * updated the mailbox. MMC regions then stay cached until it rings.
+   */
+    struct gpio_desc* doorbell;
+    atomic_t doorbell_count;
+    wait_queue_head_t doorbell_wq;
+
+    /* Open files of the character device, protected by lock */
+    struct list_head files;
+
+    /*
+   * Open files keep a reference and may outlive the device. Unbinding sets
+   * dead under unbind_sem, file operations hold it for reading.
+   */
+    struct kref refs;
+    struct rw_semaphore unbind_sem;
+    bool dead;
+
+    /* Runs io_uring commands in submission order */
+    struct workqueue_struct* uring_wq;
+
+    /* Page(s) for mmap(), updated with the shadow under lock */
+    struct mmc_mb_mmap_hdr* mmap_hdr;
+
+    /*
+   * Change poller, if there is no doorbell: poll_timer fires after
+   * poll_cur_ms (between poll_min_ms and poll_max_ms) and queues poll_work,
+   * which compares the checksum of [poll_off, poll_off + poll_len) with
+   * poll_digest. Settings are protected by lock.
+   */
+    struct hrtimer poll_timer;
+    struct work_struct poll_work;
+    unsigned int poll_min_ms;
+    unsigned int poll_max_ms;
+    unsigned int poll_cur_ms;
+    unsigned int poll_off;
+    unsigned int poll_len;
+    u32 poll_digest;
+    bool poll_primed;
+    bool poll_stopped;
+    u64 poll_changes;
+
+    /* Priority classes, see mmc_mb_lock() */
+    atomic_t urgent_waiting;
+    wait_queue_head_t prio_wq;
+    u64 bulk_yields;
+
+    /* Bytes not written because they already matched the shadow */
+    u64 delta_saved;
+
+    struct mmc_mb_region* regions;
+    unsigned int num_regions;
+
+    /* Combined transfers, only used if the adapter supports them */
+    bool comb;
+    unsigned int comb_max_msgs;
+    u16 comb_read_max;
+    u16 comb_write_max;
+    struct mmc_mb_xfer xfer;
+
+    /*
+   * lock_held tracks the mailbox lock flag. During a session (see
+   * mmc_mb_session_begin()) it is taken on the first bus access and
+   * only released at the end of the session.
+   */
+    bool lock_held;
+    bool session;
+
+    /*
+   * Lock flag hold time: lock_stamp is when it was set, sessions release it
+   * at region boundaries after lock_budget_us (0: never). lock_hist counts
+   * hold times in power of two buckets of microseconds. Protected by lock.
+   */
+    ktime_t lock_stamp;
+    unsigned int lock_budget_us;
+    u32 lock_hist[MMC_MB_LOCK_HIST_BUCKETS];
+    u32 lock_hold_max_us;
+    u64 lock_splits;
+
+    /*
+     * Optimistic reads (gen_valid): the MMC keeps a sequence counter at
+     * gen_offs, which is odd while it updates the mailbox.
+     */
+    bool gen_valid;
+    unsigned int gen_offs;
+    u64 optimistic_hits;
+    u64 optimistic_fallbacks;
+
+    /*
+   * MMC command byte (cmd_valid), checked on doorbells and poller changes.
+   * Only bits that were clear in cmd_last count as new requests, and only
+   * once cmd_last is known (cmd_known); the first value read is taken as is.
+   */
+    bool cmd_valid;
+    bool cmd_known;
+    unsigned int cmd_offs;
+    u8 cmd_last;
+    enum mmc_mb_cmd_policy cmd_policy;
+
+    /*
+   * Power off handshake: after SHDN_FINISHED, wait up to pwroff_timeout_ms
+   * for pwroff_ack_mask at pwroff_ack_offs (0: no ack bit) or for the
+   * power_good GPIO to drop.
+   */
+    unsigned int pwroff_ack_offs;
+    unsigned int pwroff_ack_mask;
+    unsigned int pwroff_timeout_ms;
+    struct gpio_desc* power_good;
+
+    /* On mmc_mb_pwroff_list; pwroff_state is only touched at power off */
+    struct list_head pwroff_node;
+    int pwroff_state;
+
+    /*
+   * Prebuilt write of the FPGA status byte (value in status_buf[2]), so
+   * the reboot and panic notifiers do not have to set anything up.
+   */
+    struct i2c_msg status_msg;
+    u8 status_buf[3];
+    struct notifier_block reboot_nb;
+    struct notifier_block panic_nb;
+
+    int id;
+    char misc_name[24];
+    struct miscdevice misc;
 };
 
 /*
@@ -50,15 +403,20 @@ struct at24_data {
  * but the 1/170 second it takes at 400 kHz may be quite reasonable; and
  * at 1 MHz (Fm+) a 1/430 second delay could easily be invisible.
  *
+ * By default (0), each device picks its own limit from the measured bus
+ * speed and its bus hold budget, see mmc_mb_calibrate(); a non-zero
+ * value caps that limit.
+ *
  * This value is forced to be a power of two so that writes align on pages.
  */
-static unsigned int mmc_mailbox_io_limit = 128;
+static unsigned int mmc_mailbox_io_limit;
 module_param_named(io_limit, mmc_mailbox_io_limit, uint, 0);
-MODULE_PARM_DESC(mmc_mailbox_io_limit, "Maximum bytes per I/O (default 128)");
+MODULE_PARM_DESC(mmc_mailbox_io_limit, "Maximum bytes per I/O (default 0 = automatic)");
 
 /*
  * Specs often allow 5 msec for a page write, sometimes 20 msec;
  * it's important to recover from write timeouts.
+ * This is the default for the retry deadline of each device.
  */
 static unsigned int at24_write_timeout = 25;
 module_param_named(write_timeout, at24_write_timeout, uint, 0);
@@ -66,10 +424,20 @@ MODULE_PARM_DESC(at24_write_timeout, "Time (in ms) to try writes (default 25)");
 
 struct at24_chip_data {
     u32 byte_len;
+    const struct mmc_mb_region_desc* regions;
+    unsigned int num_regions;
+};
+
+/* Everything not listed here is treated as a shared region */
+static const struct mmc_mb_region_desc mmc_mb_stamp_regions[] = {
+    {.start = MB_FPGA_STATUS_OFFS, .len = 1, .type = MMC_MB_REGION_CTRL},
+    {.start = MB_LOCK_OFFS, .len = 1, .type = MMC_MB_REGION_CTRL},
 };
 
 static const struct at24_chip_data at24_data_dmmc_stamp_mailbox = {
     .byte_len = 16384 / 8,
+    .regions = mmc_mb_stamp_regions,
+    .num_regions = ARRAY_SIZE(mmc_mb_stamp_regions),
 };
 
 static const struct i2c_device_id mmc_mailbox_ids[] = {
@@ -84,12 +452,106 @@ static const struct of_device_id mmc_mailbox_of_match[] = {
 };
 MODULE_DEVICE_TABLE(of, mmc_mailbox_of_match);
 
+/*
+ * Retry engine. Deadlines are tracked with ktime; the deadline is checked
+ * against the start of the failed attempt, to avoid a premature timeout in
+ * case of high CPU load.
+ */
+#define MMC_MB_RETRY_MIN_US 20
+#define MMC_MB_RETRY_MAX_US 1000
+
+static void mmc_mb_retry_start(struct at24_data* mmc_mailbox, struct mmc_mb_retry* retry)
+{
+    retry->start = ktime_get();
+    retry->deadline = ktime_add_ms(retry->start, mmc_mailbox->timeout_ms);
+    retry->attempts = 0;
+    retry->delay_us = mmc_mailbox->retry_learned_us;
+}
+
+/* Account for a failed attempt; sleeps as needed and returns false to give up */
+static bool mmc_mb_retry_again(struct at24_data* mmc_mailbox,
+                               struct mmc_mb_retry* retry,
+                               ktime_t attempt_start)
+{
+    mmc_mailbox->retry_failures++;
+
+    if (mmc_mailbox->retry_policy == MMC_MB_RETRY_NONE ||
+        !ktime_before(attempt_start, retry->deadline)) {
+        mmc_mailbox->retry_timeouts++;
+        return false;
+    }
+
+    switch (mmc_mailbox->retry_policy) {
+    case MMC_MB_RETRY_FIXED:
+        usleep_range(1000, 1500);
+        break;
+    case MMC_MB_RETRY_IMMEDIATE:
+        cond_resched();
+        break;
+    default:
+        usleep_range(retry->delay_us, retry->delay_us + retry->delay_us / 2);
+        retry->delay_us = min(2 * retry->delay_us, mmc_mailbox->retry_max_us);
+        break;
+    }
+
+    retry->attempts++;
+    return true;
+}
+
+/*
+ * Account for a successful transfer. The initial backoff follows the time
+ * that retried transfers actually needed to succeed, and slowly decays
+ * back to the minimum while transfers succeed at the first attempt.
+ */
+static void mmc_mb_retry_done(struct at24_data* mmc_mailbox, struct mmc_mb_retry* retry)
+{
+    unsigned int learned = mmc_mailbox->retry_learned_us;
+    s64 needed;
+
+    mmc_mailbox->retry_transfers++;
+
+    if (retry->attempts) {
+        needed = ktime_us_delta(ktime_get(), retry->start);
+        learned = (3 * learned + min_t(s64, needed, mmc_mailbox->retry_max_us)) / 4;
+    } else {
+        learned -= learned / 16;
+    }
+
+    mmc_mailbox->retry_learned_us =
+        clamp(learned, mmc_mailbox->retry_min_us, mmc_mailbox->retry_max_us);
+}
+
+/*
+ * Each transfer may hold the bus for hold_budget_us (3 ms by default), so
+ * that other devices on a shared bus are not starved.
+ */
+#define MMC_MB_HOLD_BUDGET_US 3000
+#define MMC_MB_DEFAULT_IO_LIMIT 128
+
+/* Derive the chunk sizes from the hold budget, must hold lock (or be probing) */
+static void mmc_mb_set_hold_budget(struct at24_data* mmc_mailbox, unsigned int budget_us)
+{
+    unsigned int hold_max = MMC_MB_DEFAULT_IO_LIMIT;
+
+    if (mmc_mailbox->byte_ns)
+        hold_max = div_u64((u64)budget_us * NSEC_PER_USEC, mmc_mailbox->byte_ns);
+    if (mmc_mailbox_io_limit)
+        hold_max = min(hold_max, mmc_mailbox_io_limit);
+    hold_max = clamp(hold_max, 1U, mmc_mailbox->byte_len);
+
+    /* A power of two, so that writes still align on pages */
+    mmc_mailbox->hold_budget_us = budget_us;
+    mmc_mailbox->hold_max = rounddown_pow_of_two(hold_max);
+    mmc_mailbox->read_max = min(mmc_mailbox->hold_max, mmc_mailbox->read_limit);
+    mmc_mailbox->write_max = min(mmc_mailbox->hold_max, mmc_mailbox->write_limit);
+}
+
 static size_t at24_adjust_read_count(struct at24_data* mmc_mailbox,
                                      unsigned int offset,
                                      size_t count)
 {
-    if (count > mmc_mailbox_io_limit)
-        count = mmc_mailbox_io_limit;
+    if (count > mmc_mailbox->read_max)
+        count = mmc_mailbox->read_max;
 
     return count;
 }
@@ -99,8 +561,9 @@ static ssize_t at24_regmap_read(struct at24_data* mmc_mailbox,
                                 unsigned int offset,
                                 size_t count)
 {
-    unsigned long timeout, read_time;
+    struct mmc_mb_retry retry;
     struct i2c_client* client;
+    ktime_t read_time;
     struct regmap* regmap;
     int ret;
 
@@ -109,21 +572,17 @@ static ssize_t at24_regmap_read(struct at24_data* mmc_mailbox,
 
     count = at24_adjust_read_count(mmc_mailbox, offset, count);
 
-    timeout = jiffies + msecs_to_jiffies(at24_write_timeout);
+    mmc_mb_retry_start(mmc_mailbox, &retry);
     do {
-        /*
-     * The timestamp shall be taken before the actual operation
-     * to avoid a premature timeout in case of high CPU load.
-     */
-        read_time = jiffies;
+        read_time = ktime_get();
 
-        ret = regmap_bulk_read(regmap, offset, buf, count);
+        ret = regmap_raw_read(regmap, offset, buf, count);
         dev_dbg(&client->dev, "read %zu@%d --> %d (%ld)\n", count, offset, ret, jiffies);
-        if (!ret)
+        if (!ret) {
+            mmc_mb_retry_done(mmc_mailbox, &retry);
             return count;
-
-        usleep_range(1000, 1500);
-    } while (time_before(read_time, timeout));
+        }
+    } while (mmc_mb_retry_again(mmc_mailbox, &retry, read_time));
 
     return -ETIMEDOUT;
 }
@@ -134,7 +593,11 @@ static ssize_t at24_regmap_read(struct at24_data* mmc_mailbox,
  * variants here, including OTP fuses and partial chip protect.
  *
  * We only use page mode writes; the alternative is sloooow. These routines
- * write at most one page.
+ * write at most one page, except in RAM mode.
+ *
+ * The STAMP mailbox is a dual port RAM without a page buffer, though.
+ * In RAM mode, writes are only split where the adapter or the lock hold
+ * budget requires it, so one write may cover the whole mailbox.
  */
 
 static size_t at24_adjust_write_count(struct at24_data* mmc_mailbox,
@@ -143,10 +606,13 @@ static size_t at24_adjust_write_count(struct at24_data* mmc_mailbox,
 {
     unsigned int next_page;
 
-    /* write_max is at most a page */
+    /* write_max is at most a page, unless in RAM mode */
     if (count > mmc_mailbox->write_max)
         count = mmc_mailbox->write_max;
 
+    if (mmc_mailbox->ram_mode)
+        return count;
+
     /* Never roll over backwards, to the start of this page */
     next_page = roundup(offset + 1, mmc_mailbox->page_size);
     if (offset + count > next_page)
@@ -160,52 +626,56 @@ static ssize_t at24_regmap_write(struct at24_data* mmc_mailbox,
                                  unsigned int offset,
                                  size_t count)
 {
-    unsigned long timeout, write_time;
+    struct mmc_mb_retry retry;
     struct i2c_client* client;
     struct regmap* regmap;
+    ktime_t write_time;
     int ret;
 
     regmap = mmc_mailbox->regmap;
     client = mmc_mailbox->client;
     count = at24_adjust_write_count(mmc_mailbox, offset, count);
-    timeout = jiffies + msecs_to_jiffies(at24_write_timeout);
 
+    mmc_mb_retry_start(mmc_mailbox, &retry);
     do {
-        /*
-     * The timestamp shall be taken before the actual operation
-     * to avoid a premature timeout in case of high CPU load.
-     */
-        write_time = jiffies;
+        write_time = ktime_get();
 
         ret = regmap_bulk_write(regmap, offset, buf, count);
         dev_dbg(&client->dev, "write %zu@%d --> %d (%ld)\n", count, offset, ret, jiffies);
-        if (!ret)
+        if (!ret) {
+            mmc_mb_retry_done(mmc_mailbox, &retry);
             return count;
-
-        usleep_range(1000, 1500);
-    } while (time_before(write_time, timeout));
+        }
+    } while (mmc_mb_retry_again(mmc_mailbox, &retry, write_time));
 
     return -ETIMEDOUT;
 }
 
-/* For read/write accesses longer than 1 byte, set the "page lock" flag
- * This flag prevents the MMC from swapping the page, protecting the critical section
- */
+static void mmc_mb_lock_account(struct at24_data* mmc_mailbox, s64 us)
+{
+    unsigned int bucket = fls64(max_t(s64, us, 0));
 
-#define MB_LOCK_OFFS 2047
-#define MB_LOCK_FLAG 0x01
+    bucket = min_t(unsigned int, bucket, MMC_MB_LOCK_HIST_BUCKETS - 1);
+
+    mmc_mailbox->lock_hist[bucket]++;
+    mmc_mailbox->lock_hold_max_us = max_t(u32, mmc_mailbox->lock_hold_max_us, us);
+}
 
 static bool lock_if_multiple(struct at24_data* mmc_mailbox, size_t count)
 {
     uint8_t tmp;
 
-    if (count <= 1) {
+    if (mmc_mailbox->lock_held || (count <= 1 && !mmc_mailbox->session)) {
         return false;
     }
     tmp = MB_LOCK_FLAG;
+    mmc_mailbox->lock_stamp = ktime_get();
     at24_regmap_write(mmc_mailbox, &tmp, MB_LOCK_OFFS, sizeof(tmp));
     //    dev_info(&mmc_mailbox->client->dev, "locked\n");
-    return true;
+    mmc_mailbox->lock_held = true;
+
+    /* Within a session, the lock is released by mmc_mb_session_end() */
+    return !mmc_mailbox->session;
 }
 
 static void unlock_if_locked(struct at24_data* mmc_mailbox, bool locked)
@@ -218,155 +688,3561 @@ static void unlock_if_locked(struct at24_data* mmc_mailbox, bool locked)
     tmp = 0;
     at24_regmap_write(mmc_mailbox, &tmp, MB_LOCK_OFFS, sizeof(tmp));
     //    dev_info(&mmc_mailbox->client->dev, "unlocked\n");
+    mmc_mailbox->lock_held = false;
+    mmc_mb_lock_account(mmc_mailbox, ktime_us_delta(ktime_get(), mmc_mailbox->lock_stamp));
 }
 
-static int at24_read(void* priv, unsigned int off, void* val, size_t count)
+/*
+ * A session groups several accesses into one critical section. The lock
+ * flag is only set once the first access actually needs the bus.
+ */
+static void mmc_mb_session_begin(struct at24_data* mmc_mailbox)
 {
-    struct at24_data* mmc_mailbox;
-    struct device* dev;
-    char* buf = val;
-    int ret;
-    bool locked;
-
-    mmc_mailbox = priv;
-    dev = &mmc_mailbox->client->dev;
+    mmc_mailbox->session = true;
+}
 
-    if (unlikely(!count))
-        return count;
+static void mmc_mb_session_end(struct at24_data* mmc_mailbox)
+{
+    mmc_mailbox->session = false;
+    unlock_if_locked(mmc_mailbox, mmc_mailbox->lock_held);
+}
 
-    if (off + count > mmc_mailbox->byte_len)
-        return -EINVAL;
+/*
+ * Combined transfers: when the adapter supports repeated STARTs, a small
+ * access is sent as a single i2c_transfer() of lock write, data transfer(s)
+ * and unlock write. It pays the bus arbitration and retry overhead once
+ * instead of three times and keeps the MMC locked out for a shorter time.
+ * Accesses larger than hold_max keep using the chunked path so that other
+ * users of the bus still get a chance in between.
+ */
 
-    ret = pm_runtime_get_sync(dev);
-    if (ret < 0) {
-        pm_runtime_put_noidle(dev);
-        return ret;
-    }
+static bool mmc_mb_xfer_add(struct at24_data* mmc_mailbox,
+                            unsigned int offset,
+                            u8* data,
+                            size_t len,
+                            bool read)
+{
+    struct mmc_mb_xfer* xfer = &mmc_mailbox->xfer;
+    struct i2c_msg* msg;
+    u8* hdr;
 
-    /*
-   * Read data from chip, protecting against concurrent updates
-   * from this host, but not from other I2C masters.
-   */
-    mutex_lock(&mmc_mailbox->lock);
-    //    dev_info(dev, "read %lu bytes at %u\n", count, off);
-    locked = lock_if_multiple(mmc_mailbox, count);
+    /* Always leave room for the unlock write */
+    if (xfer->num + (read ? 2 : 1) + (xfer->locked ? 1 : 0) > mmc_mailbox->comb_max_msgs)
+        return false;
 
-    while (count) {
-        ret = at24_regmap_read(mmc_mailbox, buf, off, count);
-        if (ret < 0) {
-            mutex_unlock(&mmc_mailbox->lock);
-            pm_runtime_put(dev);
-            return ret;
-        }
-        buf += ret;
-        off += ret;
-        count -= ret;
-    }
+    hdr = xfer->buf + xfer->used;
+    hdr[0] = offset >> 8;
+    hdr[1] = offset & 0xff;
 
-    unlock_if_locked(mmc_mailbox, locked);
-    mutex_unlock(&mmc_mailbox->lock);
+    msg = &xfer->msgs[xfer->num++];
+    msg->addr = mmc_mailbox->client->addr;
+    msg->flags = 0;
+    msg->buf = hdr;
+    msg->len = 2;
+    xfer->used += 2;
 
-    pm_runtime_put(dev);
+    if (read) {
+        msg = &xfer->msgs[xfer->num++];
+        msg->addr = mmc_mailbox->client->addr;
+        msg->flags = I2C_M_RD;
+        msg->buf = data;
+        msg->len = len;
+    } else {
+        memcpy(hdr + 2, data, len);
+        msg->len += len;
+        xfer->used += len;
+    }
 
-    return 0;
+    return true;
 }
 
-static int at24_write(void* priv, unsigned int off, void* val, size_t count)
+static void mmc_mb_xfer_begin(struct at24_data* mmc_mailbox, bool lock)
 {
-    struct at24_data* mmc_mailbox;
-    struct device* dev;
-    char* buf = val;
-    int ret;
-    bool locked;
+    struct mmc_mb_xfer* xfer = &mmc_mailbox->xfer;
+    u8 flag = MB_LOCK_FLAG;
 
-    mmc_mailbox = priv;
-    dev = &mmc_mailbox->client->dev;
+    xfer->num = 0;
+    xfer->used = 0;
+    xfer->locked = lock;
 
-    if (unlikely(!count))
-        return -EINVAL;
+    if (lock)
+        mmc_mb_xfer_add(mmc_mailbox, MB_LOCK_OFFS, &flag, sizeof(flag), false);
+}
 
-    if (off + count > mmc_mailbox->byte_len)
-        return -EINVAL;
+static int mmc_mb_xfer_run(struct at24_data* mmc_mailbox)
+{
+    struct mmc_mb_xfer* xfer = &mmc_mailbox->xfer;
+    struct i2c_client* client = mmc_mailbox->client;
+    struct mmc_mb_retry retry;
+    struct i2c_msg* msg;
+    ktime_t xfer_time;
+    u8 clear = 0;
+    int ret;
 
-    ret = pm_runtime_get_sync(dev);
-    if (ret < 0) {
-        pm_runtime_put_noidle(dev);
-        return ret;
+    if (xfer->locked) {
+        msg = &xfer->msgs[xfer->num++];
+        msg->addr = client->addr;
+        msg->flags = 0;
+        msg->buf = xfer->buf + xfer->used;
+        msg->buf[0] = MB_LOCK_OFFS >> 8;
+        msg->buf[1] = MB_LOCK_OFFS & 0xff;
+        msg->buf[2] = clear;
+        msg->len = 3;
     }
 
-    /*
-   * Write data to chip, protecting against concurrent updates
-   * from this host, but not from other I2C masters.
-   */
-    mutex_lock(&mmc_mailbox->lock);
-    //    dev_info(dev, "write %lu bytes at %u\n", count, off);
-    locked = lock_if_multiple(mmc_mailbox, count);
+    mmc_mb_retry_start(mmc_mailbox, &retry);
+    do {
+        xfer_time = ktime_get();
 
-    while (count) {
-        ret = at24_regmap_write(mmc_mailbox, buf, off, count);
-        if (ret < 0) {
-            mutex_unlock(&mmc_mailbox->lock);
-            pm_runtime_put(dev);
-            return ret;
+        ret = i2c_transfer(client->adapter, xfer->msgs, xfer->num);
+        dev_dbg(&client->dev, "xfer %u msgs --> %d (%ld)\n", xfer->num, ret, jiffies);
+        if (ret == xfer->num) {
+            mmc_mb_retry_done(mmc_mailbox, &retry);
+            if (xfer->locked)
+                mmc_mb_lock_account(mmc_mailbox, ktime_us_delta(ktime_get(), xfer_time));
+            return 0;
         }
-        buf += ret;
-        off += ret;
-        count -= ret;
-    }
+    } while (mmc_mb_retry_again(mmc_mailbox, &retry, xfer_time));
 
-    unlock_if_locked(mmc_mailbox, locked);
-    mutex_unlock(&mmc_mailbox->lock);
-
-    pm_runtime_put(dev);
+    /* The transfer may have failed after setting the lock flag */
+    if (xfer->locked)
+        at24_regmap_write(mmc_mailbox, &clear, MB_LOCK_OFFS, sizeof(clear));
 
-    return 0;
+    return -ETIMEDOUT;
 }
 
-static struct at24_data* mmc_mb_pwroff_inst = NULL;
+/* Whether a combined transfer has to set and clear the lock flag itself */
+static bool mmc_mb_comb_lock(struct at24_data* mmc_mailbox, size_t count)
+{
+    /* A session keeps the lock across transfers, so take it separately */
+    if (mmc_mailbox->session)
+        lock_if_multiple(mmc_mailbox, count);
+
+    return count > 1 && !mmc_mailbox->lock_held;
+}
 
-static void mmc_mailbox_do_poweroff(void)
+/* Returns -E2BIG if the access does not fit into one combined transfer */
+static int mmc_mb_comb_read(struct at24_data* mmc_mailbox, u8* buf, unsigned int off, size_t count)
 {
-#define MB_FPGA_STATUS_OFFS 2046
-#define MB_FPGA_STATUS_SHDN_FINISHED BIT(2)
+    size_t len;
 
-    uint8_t stat = MB_FPGA_STATUS_SHDN_FINISHED;
+    if (!mmc_mailbox->comb || count > mmc_mailbox->hold_max)
+        return -E2BIG;
 
-    if (!mmc_mb_pwroff_inst) {
-        dev_err(&mmc_mb_pwroff_inst->client->dev, "no mailbox instance available\n");
-        return;
+    mmc_mb_xfer_begin(mmc_mailbox, mmc_mb_comb_lock(mmc_mailbox, count));
+    while (count) {
+        len = min_t(size_t, count, mmc_mailbox->comb_read_max);
+        len = min_t(size_t, len, mmc_mailbox->read_max);
+        if (!mmc_mb_xfer_add(mmc_mailbox, off, buf, len, true))
+            return -E2BIG;
+        buf += len;
+        off += len;
+        count -= len;
+    }
+
+    return mmc_mb_xfer_run(mmc_mailbox);
+}
+
+static int mmc_mb_comb_write(struct at24_data* mmc_mailbox,
+                             const u8* buf,
+                             unsigned int off,
+                             size_t count)
+{
+    size_t len;
+
+    if (!mmc_mailbox->comb || count > mmc_mailbox->hold_max)
+        return -E2BIG;
+
+    mmc_mb_xfer_begin(mmc_mailbox, mmc_mb_comb_lock(mmc_mailbox, count));
+    while (count) {
+        len = at24_adjust_write_count(mmc_mailbox, off, count);
+        len = min_t(size_t, len, mmc_mailbox->comb_write_max);
+        if (!mmc_mb_xfer_add(mmc_mailbox, off, (u8*)buf, len, false))
+            return -E2BIG;
+        buf += len;
+        off += len;
+        count -= len;
+    }
+
+    return mmc_mb_xfer_run(mmc_mailbox);
+}
+
+/* The regions cover the whole mailbox, so this only fails past its end */
+static struct mmc_mb_region* mmc_mb_region_at(struct at24_data* mmc_mailbox, unsigned int off)
+{
+    struct mmc_mb_region* r = mmc_mailbox->regions;
+
+    if (off >= mmc_mailbox->byte_len)
+        return NULL;
+
+    while (off >= r->end)
+        r++;
+
+    return r;
+}
+
+/* Iterate over the regions overlapping [off, end) */
+#define mmc_mb_for_each_region(mmc_mailbox, r, off, end)                                          \
+    for (r = mmc_mb_region_at(mmc_mailbox, off);                                                  \
+         r && r < (mmc_mailbox)->regions + (mmc_mailbox)->num_regions && r->start < (end);        \
+         r++)
+
+/*
+ * Between two accesses of a session (or chunks of a large write) at prev
+ * and next: once the lock flag was held for lock_budget_us, release it if
+ * they lie in different regions or in a gap. The next access takes it
+ * again, so consistency is kept per declared region only.
+ */
+static void mmc_mb_session_checkpoint(struct at24_data* mmc_mailbox,
+                                      unsigned int prev,
+                                      unsigned int next)
+{
+    struct mmc_mb_region* r = mmc_mb_region_at(mmc_mailbox, prev);
+
+    if (!mmc_mailbox->lock_held || !mmc_mailbox->lock_budget_us)
+        return;
+    if (ktime_us_delta(ktime_get(), mmc_mailbox->lock_stamp) < mmc_mailbox->lock_budget_us)
+        return;
+    if (r == mmc_mb_region_at(mmc_mailbox, next) && !r->gap)
+        return;
+
+    unlock_if_locked(mmc_mailbox, true);
+    mmc_mailbox->lock_splits++;
+}
+
+static bool mmc_mb_region_fresh(struct at24_data* mmc_mailbox,
+                                struct mmc_mb_region* r,
+                                unsigned int start,
+                                unsigned int end,
+                                ktime_t now)
+{
+    switch (r->type) {
+    case MMC_MB_REGION_HOST:
+        return find_next_zero_bit(mmc_mailbox->shadow_known, end, start) >= end;
+    case MMC_MB_REGION_MMC:
+        if (!r->stamp)
+            return false;
+        if (!r->max_age_ms)
+            return mmc_mailbox->doorbell;
+        return ktime_ms_delta(now, r->stamp) < r->max_age_ms;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Work out which part of [off, off + count) has to come from the bus.
+ * Stale regions with a caching policy are extended to the whole region so that
+ * the shadow can serve the following reads; everything else is read as requested.
+ * Returns false if the shadow can serve the whole request.
+ */
+static bool mmc_mb_shadow_span(struct at24_data* mmc_mailbox,
+                               unsigned int off,
+                               size_t count,
+                               unsigned int* lo,
+                               unsigned int* hi)
+{
+    unsigned int end = off + count;
+    ktime_t now = ktime_get();
+    struct mmc_mb_region* r;
+    unsigned int start, stop;
+
+    *lo = UINT_MAX;
+    *hi = 0;
+
+    mmc_mb_for_each_region(mmc_mailbox, r, off, end) {
+        start = max(off, r->start);
+        stop = min(end, r->end);
+
+        if (mmc_mb_region_fresh(mmc_mailbox, r, start, stop, now))
+            continue;
+
+        if (r->type == MMC_MB_REGION_HOST ||
+            (r->type == MMC_MB_REGION_MMC && (r->max_age_ms || mmc_mailbox->doorbell))) {
+            start = r->start;
+            stop = r->end;
+        }
+        *lo = min(*lo, start);
+        *hi = max(*hi, stop);
+    }
+
+    return *lo < *hi;
+}
+
+/* MMC regions are read-only for the host */
+static bool mmc_mb_writeable(struct at24_data* mmc_mailbox, unsigned int off, size_t count)
+{
+    struct mmc_mb_region* r;
+
+    mmc_mb_for_each_region(mmc_mailbox, r, off, off + count) {
+        if (r->type == MMC_MB_REGION_MMC)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Snapshots: readers that accept data up to snapshot_ms old copy from the
+ * current snapshot under rcu_read_lock() only, so they neither wait for
+ * each other nor touch the bus. The first reader to find it stale takes
+ * lock, reads the whole mailbox and publishes a new one; readers queued
+ * behind it on lock find the fresh snapshot and return right away.
+ */
+
+static void mmc_mb_snapshot_replace(struct at24_data* mmc_mailbox, struct mmc_mb_snapshot* snap)
+{
+    struct mmc_mb_snapshot* old;
+
+    old = rcu_replace_pointer(mmc_mailbox->snapshot, snap, lockdep_is_held(&mmc_mailbox->lock));
+    if (old)
+        kfree_rcu(old, rcu);
+}
+
+/* Publish the shadow as a snapshot read at stamp, must hold lock */
+static void mmc_mb_snapshot_publish(struct at24_data* mmc_mailbox, ktime_t stamp)
+{
+    struct mmc_mb_snapshot* snap;
+
+    snap = kmalloc(struct_size(snap, data, mmc_mailbox->byte_len), GFP_KERNEL);
+    if (snap) {
+        memcpy(snap->data, mmc_mailbox->shadow, mmc_mailbox->byte_len);
+        snap->version = ++mmc_mailbox->snapshot_version;
+        snap->stamp = stamp;
+    }
+
+    mmc_mb_snapshot_replace(mmc_mailbox, snap);
+}
+
+/*
+ * Host writes go into a copy of the current snapshot, which keeps its stamp
+ * since the rest of the data is not any newer. Must hold lock.
+ */
+static void mmc_mb_snapshot_patch(struct at24_data* mmc_mailbox, unsigned int off, size_t count)
+{
+    struct mmc_mb_snapshot *old, *snap;
+
+    old = rcu_dereference_protected(mmc_mailbox->snapshot, lockdep_is_held(&mmc_mailbox->lock));
+    if (!old)
+        return;
+
+    snap = kmalloc(struct_size(snap, data, mmc_mailbox->byte_len), GFP_KERNEL);
+    if (snap) {
+        memcpy(snap->data, old->data, mmc_mailbox->byte_len);
+        memcpy(snap->data + off, mmc_mailbox->shadow + off, count);
+        snap->version = ++mmc_mailbox->snapshot_version;
+        snap->stamp = old->stamp;
+    }
+
+    mmc_mb_snapshot_replace(mmc_mailbox, snap);
+}
+
+static bool mmc_mb_snapshot_fresh(struct mmc_mb_snapshot* snap, unsigned int max_age_ms)
+{
+    return snap && ktime_ms_delta(ktime_get(), snap->stamp) < max_age_ms;
+}
+
+/* Lockless read from the snapshot, false if there is no fresh one */
+static bool mmc_mb_snapshot_read(struct at24_data* mmc_mailbox,
+                                 void* val,
+                                 unsigned int off,
+                                 size_t count)
+{
+    unsigned int max_age_ms = READ_ONCE(mmc_mailbox->snapshot_ms);
+    struct mmc_mb_snapshot* snap;
+    bool hit = false;
+
+    if (!max_age_ms)
+        return false;
+
+    rcu_read_lock();
+    snap = rcu_dereference(mmc_mailbox->snapshot);
+    if (mmc_mb_snapshot_fresh(snap, max_age_ms)) {
+        memcpy(val, snap->data + off, count);
+        hit = true;
+    }
+    rcu_read_unlock();
+
+    return hit;
+}
+
+/* Whether the snapshot needs a refresh, must hold lock */
+static bool mmc_mb_snapshot_stale(struct at24_data* mmc_mailbox)
+{
+    struct mmc_mb_snapshot* snap;
+
+    snap = rcu_dereference_protected(mmc_mailbox->snapshot, lockdep_is_held(&mmc_mailbox->lock));
+
+    return !mmc_mb_snapshot_fresh(snap, mmc_mailbox->snapshot_ms);
+}
+
+static void mmc_mb_snapshot_release(void* data)
+{
+    struct at24_data* mmc_mailbox = data;
+
+    kfree(rcu_dereference_protected(mmc_mailbox->snapshot, true));
+}
+
+/*
+ * Watches: files of the character device can watch byte ranges. Whenever
+ * bytes change in the shadow, the files watching them become readable.
+ */
+
+/* Must hold lock */
+static void mmc_mb_watch_changed(struct at24_data* mmc_mailbox, unsigned int lo, unsigned int hi)
+{
+    struct mmc_mb_file* ctx;
+    struct mmc_mb_range* w;
+    bool wake = false;
+    unsigned int i;
+
+    list_for_each_entry(ctx, &mmc_mailbox->files, node) {
+        for (i = 0; i < ctx->num_watch; i++) {
+            w = &ctx->watch[i];
+            if (w->offset < hi && w->offset + w->len > lo) {
+                WRITE_ONCE(ctx->changed, true);
+                wake = true;
+                break;
+            }
+        }
+    }
+
+    if (wake)
+        wake_up_interruptible(&mmc_mailbox->doorbell_wq);
+}
+
+/* Copy data into the shadow at off, reporting the bytes that change */
+static void mmc_mb_watch_copy(struct at24_data* mmc_mailbox,
+                              unsigned int off,
+                              const u8* data,
+                              size_t count)
+{
+    u8* shadow = mmc_mailbox->shadow + off;
+    size_t first, last;
+
+    for (first = 0; first < count && shadow[first] == data[first]; first++)
+        ;
+    if (first == count)
+        return;
+    for (last = count; shadow[last - 1] == data[last - 1]; last--)
+        ;
+
+    memcpy(shadow + first, data + first, last - first);
+    if (!list_empty(&mmc_mailbox->files))
+        mmc_mb_watch_changed(mmc_mailbox, off + first, off + last);
+}
+
+/*
+ * Copy [off, off + count) of the shadow to the mmap() page, must hold lock.
+ * Userspace reads it without any locking, so follow the seqcount protocol.
+ */
+static void mmc_mb_mmap_update(struct at24_data* mmc_mailbox,
+                               unsigned int off,
+                               size_t count,
+                               ktime_t stamp)
+{
+    struct mmc_mb_mmap_hdr* hdr = mmc_mailbox->mmap_hdr;
+
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+    smp_wmb();
+
+    memcpy((u8*)(hdr + 1) + off, mmc_mailbox->shadow + off, count);
+    if (stamp)
+        hdr->stamp_ns = ktime_to_ns(stamp);
+
+    smp_wmb();
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+}
+
+/*
+ * Merge data into the shadow. stamp is the time the data was read from the
+ * bus (taken before the transfer started), or 0 for data written by the host.
+ */
+static void mmc_mb_shadow_update(struct at24_data* mmc_mailbox,
+                                 unsigned int off,
+                                 size_t count,
+                                 const u8* data,
+                                 ktime_t stamp)
+{
+    unsigned int end = off + count;
+    unsigned int pos, dirty;
+    struct mmc_mb_region* r;
+
+    if (!stamp) {
+        /* Flushes pass the shadow itself */
+        if (data != mmc_mailbox->shadow + off)
+            mmc_mb_watch_copy(mmc_mailbox, off, data, count);
+        bitmap_clear(mmc_mailbox->shadow_dirty, off, count);
+        mmc_mb_snapshot_patch(mmc_mailbox, off, count);
+    } else {
+        /* Don't overwrite data that is still waiting to be written back */
+        for (pos = off; pos < end;) {
+            dirty = find_next_bit(mmc_mailbox->shadow_dirty, end, pos);
+            mmc_mb_watch_copy(mmc_mailbox, pos, data + (pos - off), dirty - pos);
+            pos = find_next_zero_bit(mmc_mailbox->shadow_dirty, end, dirty);
+        }
+    }
+
+    mmc_mb_for_each_region(mmc_mailbox, r, off, end) {
+        if (r->type == MMC_MB_REGION_HOST)
+            bitmap_set(mmc_mailbox->shadow_known,
+                       max(off, r->start),
+                       min(end, r->end) - max(off, r->start));
+        else if (r->type == MMC_MB_REGION_MMC && stamp && off <= r->start && end >= r->end)
+            r->stamp = stamp;
+    }
+
+    mmc_mb_mmap_update(mmc_mailbox, off, count, stamp);
+}
+
+/*
+ * Optimistic reads, modelled after seqlocks: read the generation counter,
+ * the data and the counter again, all without the lock flag. The data is
+ * good if the counter was even and did not change in between. Otherwise
+ * the caller falls back to a locked read after a few tries. On adapters
+ * with combined transfers, all three reads are a single transfer.
+ */
+#define MMC_MB_OPTIMISTIC_TRIES 3
+
+static int mmc_mb_gen_read_comb(struct at24_data* mmc_mailbox,
+                                u8* buf,
+                                unsigned int off,
+                                size_t count,
+                                u8* gen)
+{
+    size_t len;
+
+    if (!mmc_mailbox->comb || count > mmc_mailbox->hold_max)
+        return -E2BIG;
+
+    mmc_mb_xfer_begin(mmc_mailbox, false);
+    if (!mmc_mb_xfer_add(mmc_mailbox, mmc_mailbox->gen_offs, &gen[0], 1, true))
+        return -E2BIG;
+    while (count) {
+        len = min_t(size_t, count, mmc_mailbox->comb_read_max);
+        len = min_t(size_t, len, mmc_mailbox->read_max);
+        if (!mmc_mb_xfer_add(mmc_mailbox, off, buf, len, true))
+            return -E2BIG;
+        buf += len;
+        off += len;
+        count -= len;
+    }
+    if (!mmc_mb_xfer_add(mmc_mailbox, mmc_mailbox->gen_offs, &gen[1], 1, true))
+        return -E2BIG;
+
+    return mmc_mb_xfer_run(mmc_mailbox);
+}
+
+static int mmc_mb_gen_read_chunked(struct at24_data* mmc_mailbox,
+                                   u8* buf,
+                                   unsigned int off,
+                                   size_t count,
+                                   u8* gen)
+{
+    ssize_t ret;
+
+    ret = at24_regmap_read(mmc_mailbox, &gen[0], mmc_mailbox->gen_offs, 1);
+    if (ret < 0)
+        return ret;
+
+    /* Update in progress, don't bother reading the data */
+    if (gen[0] & 1)
+        return 0;
+
+    while (count) {
+        ret = at24_regmap_read(mmc_mailbox, buf, off, count);
+        if (ret < 0)
+            return ret;
+        buf += ret;
+        off += ret;
+        count -= ret;
+    }
+
+    ret = at24_regmap_read(mmc_mailbox, &gen[1], mmc_mailbox->gen_offs, 1);
+
+    return ret < 0 ? ret : 0;
+}
+
+/* Returns -EAGAIN if a locked read is needed */
+static int mmc_mb_optimistic_read(struct at24_data* mmc_mailbox, unsigned int off, size_t count)
+{
+    u8* buf = mmc_mailbox->bounce + off;
+    u8 gen[2];
+    int i, ret;
+
+    /* A session holds the lock anyway */
+    if (!mmc_mailbox->gen_valid || count <= 1 || mmc_mailbox->lock_held || mmc_mailbox->session)
+        return -EAGAIN;
+
+    for (i = 0; i < MMC_MB_OPTIMISTIC_TRIES; i++) {
+        ret = mmc_mb_gen_read_comb(mmc_mailbox, buf, off, count, gen);
+        if (ret == -E2BIG)
+            ret = mmc_mb_gen_read_chunked(mmc_mailbox, buf, off, count, gen);
+        if (ret < 0)
+            return ret;
+
+        if (!(gen[0] & 1) && gen[0] == gen[1]) {
+            mmc_mailbox->optimistic_hits++;
+            return 0;
+        }
+    }
+
+    mmc_mailbox->optimistic_fallbacks++;
+
+    return -EAGAIN;
+}
+
+/* Refresh [off, off + count) of the shadow in one lock session, must hold lock */
+static int __mmc_mb_shadow_fill(struct at24_data* mmc_mailbox, unsigned int off, size_t count)
+{
+    u8* buf = mmc_mailbox->bounce + off;
+    unsigned int pos = off;
+    size_t left = count;
+    ktime_t stamp;
+    ssize_t ret = 0;
+    bool locked;
+
+    stamp = ktime_get();
+
+    ret = mmc_mb_optimistic_read(mmc_mailbox, off, count);
+    if (ret != -EAGAIN) {
+        if (!ret)
+            mmc_mb_shadow_update(mmc_mailbox, off, count, buf, stamp);
+        return ret;
+    }
+
+    ret = mmc_mb_comb_read(mmc_mailbox, buf, off, count);
+    if (ret != -E2BIG) {
+        if (!ret)
+            mmc_mb_shadow_update(mmc_mailbox, off, count, buf, stamp);
+        return ret;
+    }
+    ret = 0;
+
+    locked = lock_if_multiple(mmc_mailbox, count);
+
+    while (left) {
+        ret = at24_regmap_read(mmc_mailbox, mmc_mailbox->bounce + pos, pos, left);
+        if (ret < 0)
+            break;
+        pos += ret;
+        left -= ret;
+    }
+
+    unlock_if_locked(mmc_mailbox, locked);
+    if (ret < 0)
+        return ret;
+
+    mmc_mb_shadow_update(mmc_mailbox, off, count, buf, stamp);
+
+    return 0;
+}
+
+/*
+ * Priorities: accesses that fit into one transfer chunk (hold_max bytes)
+ * are urgent, larger ones are bulk. Bulk accesses wait for the urgent ones
+ * that are already queued, and bulk reads that span several regions read
+ * each region in a lock session of its own, between which they let waiting
+ * urgent accesses go first.
+ */
+
+static void mmc_mb_lock(struct at24_data* mmc_mailbox, size_t count)
+{
+    if (count > READ_ONCE(mmc_mailbox->hold_max)) {
+        wait_event(mmc_mailbox->prio_wq, !atomic_read(&mmc_mailbox->urgent_waiting));
+        mutex_lock(&mmc_mailbox->lock);
+        return;
+    }
+
+    atomic_inc(&mmc_mailbox->urgent_waiting);
+    mutex_lock(&mmc_mailbox->lock);
+    if (atomic_dec_and_test(&mmc_mailbox->urgent_waiting))
+        wake_up(&mmc_mailbox->prio_wq);
+}
+
+/* Let waiting urgent accesses run, drops lock in between */
+static void mmc_mb_yield(struct at24_data* mmc_mailbox)
+{
+    if (!atomic_read(&mmc_mailbox->urgent_waiting))
+        return;
+
+    mmc_mailbox->bulk_yields++;
+    mutex_unlock(&mmc_mailbox->lock);
+    wait_event(mmc_mailbox->prio_wq, !atomic_read(&mmc_mailbox->urgent_waiting));
+    mutex_lock(&mmc_mailbox->lock);
+}
+
+/*
+ * End of the next fill session from off on: whole regions, merged up to
+ * hold_max. Gaps promise no consistency, so they are split at hold_max.
+ */
+static unsigned int mmc_mb_fill_end(struct at24_data* mmc_mailbox,
+                                    unsigned int off,
+                                    unsigned int end)
+{
+    unsigned int limit = off + mmc_mailbox->hold_max;
+    struct mmc_mb_region* r = mmc_mb_region_at(mmc_mailbox, off);
+    unsigned int next = min(end, r->gap ? min(limit, r->end) : r->end);
+    unsigned int more;
+
+    while (next < end) {
+        r = mmc_mb_region_at(mmc_mailbox, next);
+        more = min(end, r->gap ? min(limit, r->end) : r->end);
+        if (more > limit || more <= next)
+            break;
+        next = more;
+    }
+
+    return next;
+}
+
+/*
+ * Refresh [off, off + count) of the shadow from the bus, must hold lock.
+ * Each declared region is read in one lock session, so it is always
+ * consistent; gaps are read in pieces of at most hold_max.
+ * Between regions, bulk reads let waiting urgent accesses go first outside
+ * of a session, and may release the lock flag within one (see
+ * mmc_mb_session_checkpoint()).
+ */
+static int mmc_mb_shadow_fill(struct at24_data* mmc_mailbox, unsigned int off, size_t count)
+{
+    unsigned int end = off + count;
+    unsigned int pos, next;
+    int ret;
+
+    if (count <= mmc_mailbox->hold_max)
+        return __mmc_mb_shadow_fill(mmc_mailbox, off, count);
+
+    for (pos = off; pos < end; pos = next) {
+        if (pos > off && mmc_mailbox->session)
+            mmc_mb_session_checkpoint(mmc_mailbox, pos - 1, pos);
+        else if (pos > off)
+            mmc_mb_yield(mmc_mailbox);
+
+        next = mmc_mb_fill_end(mmc_mailbox, pos, end);
+        ret = __mmc_mb_shadow_fill(mmc_mailbox, pos, next - pos);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Write [off, off + count) to the bus and the shadow, must hold lock.
+ * With a lock budget, chunks stop at region ends so that the lock flag
+ * can be released in between (see mmc_mb_session_checkpoint()).
+ */
+static int mmc_mb_bus_write(struct at24_data* mmc_mailbox,
+                            const u8* buf,
+                            unsigned int off,
+                            size_t count)
+{
+    unsigned int start = off;
+    ssize_t ret;
+    size_t len;
+    bool locked;
+
+    ret = mmc_mb_comb_write(mmc_mailbox, buf, off, count);
+    if (ret != -E2BIG) {
+        if (!ret)
+            mmc_mb_shadow_update(mmc_mailbox, off, count, buf, 0);
+        return ret;
+    }
+    ret = 0;
+
+    locked = lock_if_multiple(mmc_mailbox, count);
+
+    while (count) {
+        if (off > start) {
+            mmc_mb_session_checkpoint(mmc_mailbox, off - 1, off);
+            if (!mmc_mailbox->lock_held)
+                locked = lock_if_multiple(mmc_mailbox, count);
+        }
+
+        len = count;
+        if (mmc_mailbox->lock_budget_us)
+            len = min_t(size_t, len, mmc_mb_region_at(mmc_mailbox, off)->end - off);
+
+        ret = at24_regmap_write(mmc_mailbox, buf, off, len);
+        if (ret < 0)
+            break;
+        mmc_mb_shadow_update(mmc_mailbox, off, ret, buf, 0);
+        buf += ret;
+        off += ret;
+        count -= ret;
+    }
+
+    unlock_if_locked(mmc_mailbox, locked);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Delta writes: bytes of host regions whose shadow content is known to be on
+ * the chip are only written if they change. Unchanged bytes between two
+ * changes are written anyway if there are at most MMC_MB_DELTA_MERGE_GAP of
+ * them, since another write message (address + offset) costs about as much.
+ */
+#define MMC_MB_DELTA_MERGE_GAP 3
+
+static bool mmc_mb_delta_same(struct at24_data* mmc_mailbox,
+                              const u8* buf,
+                              unsigned int off,
+                              unsigned int pos)
+{
+    return test_bit(pos, mmc_mailbox->shadow_known) && !test_bit(pos, mmc_mailbox->shadow_dirty) &&
+           mmc_mailbox->shadow[pos] == buf[pos - off];
+}
+
+/* Find the next run of changed bytes of [off, end) starting at from */
+static bool mmc_mb_delta_next(struct at24_data* mmc_mailbox,
+                              const u8* buf,
+                              unsigned int off,
+                              unsigned int end,
+                              unsigned int from,
+                              unsigned int* start,
+                              unsigned int* stop)
+{
+    unsigned int pos;
+
+    for (pos = from; pos < end && mmc_mb_delta_same(mmc_mailbox, buf, off, pos); pos++)
+        ;
+    if (pos >= end)
+        return false;
+
+    *start = pos;
+    for (*stop = pos; pos < end; pos++) {
+        if (!mmc_mb_delta_same(mmc_mailbox, buf, off, pos))
+            *stop = pos + 1;
+        else if (pos + 1 - *stop > MMC_MB_DELTA_MERGE_GAP)
+            break;
+    }
+
+    return true;
+}
+
+/* Write only the changed parts of [off, off + count), must hold lock */
+static int mmc_mb_delta_write(struct at24_data* mmc_mailbox,
+                              const u8* buf,
+                              unsigned int off,
+                              size_t count)
+{
+    unsigned int end = off + count;
+    unsigned int start, stop, next_start, next_stop;
+    size_t written = 0;
+    bool more, session;
+    int ret;
+
+    if (!mmc_mb_delta_next(mmc_mailbox, buf, off, end, off, &start, &stop)) {
+        mmc_mailbox->delta_saved += count;
+        return 0;
+    }
+
+    more = mmc_mb_delta_next(mmc_mailbox, buf, off, end, stop, &next_start, &next_stop);
+
+    /* Several runs still have to be consistent as a whole */
+    session = more && !mmc_mailbox->session;
+    if (session)
+        mmc_mb_session_begin(mmc_mailbox);
+
+    for (;;) {
+        ret = mmc_mb_bus_write(mmc_mailbox, buf + (start - off), start, stop - start);
+        if (ret)
+            break;
+        written += stop - start;
+
+        if (!more)
+            break;
+        mmc_mb_session_checkpoint(mmc_mailbox, stop - 1, next_start);
+        start = next_start;
+        stop = next_stop;
+        more = mmc_mb_delta_next(mmc_mailbox, buf, off, end, stop, &next_start, &next_stop);
+    }
+
+    if (session)
+        mmc_mb_session_end(mmc_mailbox);
+
+    if (!ret)
+        mmc_mailbox->delta_saved += count - written;
+
+    return ret;
+}
+
+/* Whether [off, off + count) lies entirely within host regions */
+static bool mmc_mb_host_only(struct at24_data* mmc_mailbox, unsigned int off, size_t count)
+{
+    struct mmc_mb_region* r;
+
+    mmc_mb_for_each_region(mmc_mailbox, r, off, off + count) {
+        if (r->type != MMC_MB_REGION_HOST)
+            return false;
+    }
+
+    return true;
+}
+
+/* Write-back: only update the shadow, must hold lock */
+static void mmc_mb_write_back(struct at24_data* mmc_mailbox,
+                              const u8* buf,
+                              unsigned int off,
+                              size_t count)
+{
+    mmc_mb_watch_copy(mmc_mailbox, off, buf, count);
+    bitmap_set(mmc_mailbox->shadow_known, off, count);
+    bitmap_set(mmc_mailbox->shadow_dirty, off, count);
+    mmc_mb_snapshot_patch(mmc_mailbox, off, count);
+    mmc_mb_mmap_update(mmc_mailbox, off, count, 0);
+
+    /* The deadline counts from the first pending write, not the last one */
+    schedule_delayed_work(&mmc_mailbox->flush_work, msecs_to_jiffies(mmc_mailbox->writeback_ms));
+}
+
+/*
+ * Write back all dirty bytes within one lock session, must hold lock.
+ * Dirty runs within the same page (or close to each other) are merged when
+ * the bytes in between are known, so each page costs at most one bus write.
+ */
+static int __mmc_mb_flush(struct at24_data* mmc_mailbox)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    unsigned long* dirty = mmc_mailbox->shadow_dirty;
+    unsigned long* known = mmc_mailbox->shadow_known;
+    unsigned int size = mmc_mailbox->byte_len;
+    unsigned int start, end, next;
+    int ret;
+
+    start = find_first_bit(dirty, size);
+    if (start >= size)
+        return 0;
+
+    ret = pm_runtime_get_sync(dev);
+    if (ret < 0) {
+        pm_runtime_put_noidle(dev);
+        return ret;
+    }
+
+    mmc_mb_session_begin(mmc_mailbox);
+
+    for (ret = 0; start < size && !ret; start = find_next_bit(dirty, size, end)) {
+        end = find_next_zero_bit(dirty, size, start);
+
+        for (next = find_next_bit(dirty, size, end); next < size;
+             next = find_next_bit(dirty, size, end)) {
+            if ((mmc_mailbox->ram_mode || rounddown(next, mmc_mailbox->page_size) > end - 1) &&
+                next - end > MMC_MB_DELTA_MERGE_GAP)
+                break;
+            if (find_next_zero_bit(known, next, end) < next)
+                break;
+            end = find_next_zero_bit(dirty, size, next);
+        }
+
+        ret = mmc_mb_bus_write(mmc_mailbox, mmc_mailbox->shadow + start, start, end - start);
+        next = find_next_bit(dirty, size, end);
+        if (!ret && next < size)
+            mmc_mb_session_checkpoint(mmc_mailbox, end - 1, next);
+    }
+
+    mmc_mb_session_end(mmc_mailbox);
+
+    pm_runtime_put(dev);
+
+    return ret;
+}
+
+static int mmc_mb_flush(struct at24_data* mmc_mailbox)
+{
+    int ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    ret = __mmc_mb_flush(mmc_mailbox);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return ret;
+}
+
+static void mmc_mb_flush_work(struct work_struct* work)
+{
+    struct at24_data* mmc_mailbox;
+    int ret;
+
+    mmc_mailbox = container_of(to_delayed_work(work), struct at24_data, flush_work);
+
+    ret = mmc_mb_flush(mmc_mailbox);
+    if (ret) {
+        dev_err_ratelimited(&mmc_mailbox->client->dev, "write-back failed: %d\n", ret);
+        schedule_delayed_work(&mmc_mailbox->flush_work,
+                              msecs_to_jiffies(mmc_mailbox->writeback_ms));
+    }
+}
+
+/*
+ * Registered before the nvmem and the misc device, so that no write can
+ * arm flush_work again once this ran on unbind. Runtime PM is still enabled
+ * at that point, see mmc_mb_pm_release().
+ */
+static void mmc_mb_flush_release(void* data)
+{
+    struct at24_data* mmc_mailbox = data;
+
+    cancel_delayed_work_sync(&mmc_mailbox->flush_work);
+    if (mmc_mb_flush(mmc_mailbox))
+        dev_err(&mmc_mailbox->client->dev, "failed to write back pending data\n");
+}
+
+/*
+ * Read merging: concurrent readers of the same data queue up on lock. The
+ * one that gets it extends its bus read to all queued requests overlapping
+ * it. The others then find their range covered by a bus read that started
+ * after they were queued, and copy from the shadow without another transfer.
+ */
+
+static void mmc_mb_read_queue(struct at24_data* mmc_mailbox,
+                              struct mmc_mb_read_req* req,
+                              unsigned int off,
+                              size_t count)
+{
+    req->lo = off;
+    req->hi = off + count;
+    req->queued = ktime_get();
+
+    spin_lock(&mmc_mailbox->reads_lock);
+    list_add_tail(&req->node, &mmc_mailbox->reads);
+    spin_unlock(&mmc_mailbox->reads_lock);
+}
+
+static void mmc_mb_read_dequeue(struct at24_data* mmc_mailbox, struct mmc_mb_read_req* req)
+{
+    spin_lock(&mmc_mailbox->reads_lock);
+    list_del(&req->node);
+    spin_unlock(&mmc_mailbox->reads_lock);
+}
+
+/* Whether a bus read since req was queued covers it, must hold lock */
+static bool mmc_mb_read_merged(struct at24_data* mmc_mailbox, struct mmc_mb_read_req* req)
+{
+    struct mmc_mb_fill* fill;
+    int i;
+
+    for (i = 0; i < MMC_MB_FILL_HISTORY; i++) {
+        fill = &mmc_mailbox->fills[i];
+        if (fill->lo <= req->lo && fill->hi >= req->hi &&
+            ktime_compare(fill->stamp, req->queued) >= 0) {
+            mmc_mailbox->merged_reads++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Grow [*lo, *hi) by the queued requests overlapping or touching it */
+static void mmc_mb_read_merge(struct at24_data* mmc_mailbox, unsigned int* lo, unsigned int* hi)
+{
+    struct mmc_mb_read_req* req;
+    bool grown;
+
+    spin_lock(&mmc_mailbox->reads_lock);
+    do {
+        grown = false;
+        list_for_each_entry(req, &mmc_mailbox->reads, node) {
+            if (req->lo > *hi || req->hi < *lo)
+                continue;
+            if (req->lo < *lo || req->hi > *hi) {
+                *lo = min(*lo, req->lo);
+                *hi = max(*hi, req->hi);
+                grown = true;
+            }
+        }
+    } while (grown);
+    spin_unlock(&mmc_mailbox->reads_lock);
+}
+
+/* Must hold lock */
+static void mmc_mb_read_record(struct at24_data* mmc_mailbox,
+                               unsigned int lo,
+                               unsigned int hi,
+                               ktime_t stamp)
+{
+    struct mmc_mb_fill* fill;
+
+    fill = &mmc_mailbox->fills[mmc_mailbox->fill_next++ % MMC_MB_FILL_HISTORY];
+    fill->lo = lo;
+    fill->hi = hi;
+    fill->stamp = stamp;
+}
+
+static int at24_read(void* priv, unsigned int off, void* val, size_t count)
+{
+    struct at24_data* mmc_mailbox;
+    struct mmc_mb_read_req req;
+    unsigned int lo, hi, ulo, uhi;
+    struct device* dev;
+    ktime_t stamp;
+    bool miss;
+    int ret = 0;
+
+    mmc_mailbox = priv;
+    dev = &mmc_mailbox->client->dev;
+
+    if (unlikely(!count))
+        return count;
+
+    if (off + count > mmc_mailbox->byte_len)
+        return -EINVAL;
+
+    ret = wait_for_completion_killable(&mmc_mailbox->ready);
+    if (ret)
+        return ret;
+
+    /*
+   * Read data from chip, protecting against concurrent updates
+   * from this host, but not from other I2C masters.
+   */
+    if (mmc_mb_snapshot_read(mmc_mailbox, val, off, count))
+        return 0;
+
+    mmc_mb_read_queue(mmc_mailbox, &req, off, count);
+    mmc_mb_lock(mmc_mailbox, count);
+    mmc_mb_read_dequeue(mmc_mailbox, &req);
+    //    dev_info(dev, "read %lu bytes at %u\n", count, off);
+
+    ulo = off;
+    uhi = off + count;
+
+    /* In snapshot mode, refresh the whole mailbox */
+    if (mmc_mailbox->snapshot_ms) {
+        miss = mmc_mb_snapshot_stale(mmc_mailbox);
+        lo = 0;
+        hi = mmc_mailbox->byte_len;
+    } else if (mmc_mb_read_merged(mmc_mailbox, &req)) {
+        miss = false;
+    } else {
+        mmc_mb_read_merge(mmc_mailbox, &ulo, &uhi);
+        miss = mmc_mb_shadow_span(mmc_mailbox, ulo, uhi - ulo, &lo, &hi);
+    }
+
+    if (miss) {
+        ret = pm_runtime_get_sync(dev);
+        if (ret < 0) {
+            pm_runtime_put_noidle(dev);
+            mutex_unlock(&mmc_mailbox->lock);
+            return ret;
+        }
+
+        stamp = ktime_get();
+        /* A snapshot has to be one consistent image, so never split it */
+        if (mmc_mailbox->snapshot_ms)
+            ret = __mmc_mb_shadow_fill(mmc_mailbox, lo, hi - lo);
+        else
+            ret = mmc_mb_shadow_fill(mmc_mailbox, lo, hi - lo);
+        if (!ret && mmc_mailbox->snapshot_ms)
+            mmc_mb_snapshot_publish(mmc_mailbox, stamp);
+        else if (!ret)
+            mmc_mb_read_record(mmc_mailbox, ulo, uhi, stamp);
+        pm_runtime_put(dev);
+    }
+
+    if (!ret)
+        memcpy(val, mmc_mailbox->shadow + off, count);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return ret;
+}
+
+static int at24_write(void* priv, unsigned int off, void* val, size_t count)
+{
+    struct at24_data* mmc_mailbox;
+    struct device* dev;
+    int ret;
+
+    mmc_mailbox = priv;
+    dev = &mmc_mailbox->client->dev;
+
+    if (unlikely(!count))
+        return -EINVAL;
+
+    if (off + count > mmc_mailbox->byte_len)
+        return -EINVAL;
+
+    if (!mmc_mb_writeable(mmc_mailbox, off, count))
+        return -EACCES;
+
+    ret = wait_for_completion_killable(&mmc_mailbox->ready);
+    if (ret)
+        return ret;
+
+    if (READ_ONCE(mmc_mailbox->writeback_ms) && mmc_mb_host_only(mmc_mailbox, off, count)) {
+        mmc_mb_lock(mmc_mailbox, count);
+        mmc_mb_write_back(mmc_mailbox, val, off, count);
+        mutex_unlock(&mmc_mailbox->lock);
+        return 0;
+    }
+
+    ret = pm_runtime_get_sync(dev);
+    if (ret < 0) {
+        pm_runtime_put_noidle(dev);
+        return ret;
+    }
+
+    /*
+   * Write data to chip, protecting against concurrent updates
+   * from this host, but not from other I2C masters.
+   */
+    mmc_mb_lock(mmc_mailbox, count);
+    //    dev_info(dev, "write %lu bytes at %u\n", count, off);
+    ret = mmc_mb_delta_write(mmc_mailbox, val, off, count);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    pm_runtime_put(dev);
+
+    return ret;
+}
+
+/*
+ * Character device: /dev/mmc-mailboxN
+ */
+
+/*
+ * Wake up everybody who waits for an update: poll() on the character
+ * device, or sysfs_notify() for poll() on the eeprom file. Only a real
+ * doorbell ring counts in doorbell_count (and so raises EPOLLPRI), a change
+ * found by the poller does not.
+ */
+static void mmc_mb_notify(struct at24_data* mmc_mailbox, bool doorbell)
+{
+    struct kobject* kobj = &mmc_mailbox->client->dev.kobj;
+
+    if (doorbell)
+        atomic_inc(&mmc_mailbox->doorbell_count);
+    wake_up_interruptible(&mmc_mailbox->doorbell_wq);
+    sysfs_notify(kobj, NULL, "eeprom");
+    if (doorbell)
+        sysfs_notify(kobj, NULL, "doorbell_count");
+}
+
+/* Watchers only see changes on bus reads, so fetch their ranges. Must hold lock */
+static void mmc_mb_watch_refresh(struct at24_data* mmc_mailbox)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    unsigned int i, lo = mmc_mailbox->byte_len, hi = 0;
+    struct mmc_mb_file* ctx;
+    int ret;
+
+    list_for_each_entry(ctx, &mmc_mailbox->files, node) {
+        for (i = 0; i < ctx->num_watch; i++) {
+            lo = min(lo, ctx->watch[i].offset);
+            hi = max(hi, ctx->watch[i].offset + ctx->watch[i].len);
+        }
+    }
+    if (lo >= hi)
+        return;
+
+    ret = pm_runtime_get_sync(dev);
+    if (ret < 0) {
+        pm_runtime_put_noidle(dev);
+        return;
+    }
+
+    ret = mmc_mb_shadow_fill(mmc_mailbox, lo, hi - lo);
+    if (ret)
+        dev_dbg(dev, "watch refresh failed: %d\n", ret);
+
+    pm_runtime_put(dev);
+}
+
+/*
+ * Doorbell: the MMC has changed the mailbox. Forget the age of everything
+ * it owns, so the next read fetches it again, fetch the watched ranges
+ * and notify the waiters.
+ */
+/* Read the MMC command byte from the bus, must hold lock */
+static int mmc_mb_command_read(struct at24_data* mmc_mailbox, u8* cmd)
+{
+    int ret;
+
+    ret = mmc_mb_shadow_fill(mmc_mailbox, mmc_mailbox->cmd_offs, 1);
+    if (!ret)
+        *cmd = mmc_mailbox->shadow[mmc_mailbox->cmd_offs];
+
+    return ret;
+}
+
+/*
+ * Act on new requests in the command byte. Called after a doorbell or a
+ * change seen by the poller, without holding lock.
+ */
+static void mmc_mb_command_check(struct at24_data* mmc_mailbox)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    char* envp[] = {"MMC_COMMAND=shutdown", NULL};
+    enum mmc_mb_cmd_policy policy;
+    u8 cmd, req = 0;
+    int ret;
+
+    /*
+     * No waiting for the prefill here: this may run in the doorbell thread,
+     * which free_irq() waits for if probe fails before the prefill is queued.
+     * Whichever reads the command byte first sets the baseline.
+     */
+    if (!mmc_mailbox->cmd_valid)
+        return;
+
+    ret = pm_runtime_get_sync(dev);
+    if (ret < 0) {
+        pm_runtime_put_noidle(dev);
+        dev_err_ratelimited(dev, "failed to resume for MMC command: %d\n", ret);
+        return;
+    }
+
+    mutex_lock(&mmc_mailbox->lock);
+    ret = mmc_mb_command_read(mmc_mailbox, &cmd);
+    if (!ret) {
+        req = mmc_mailbox->cmd_known ? cmd & ~mmc_mailbox->cmd_last : 0;
+        mmc_mailbox->cmd_last = cmd;
+        mmc_mailbox->cmd_known = true;
+    }
+    policy = mmc_mailbox->cmd_policy;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    pm_runtime_put(dev);
+
+    if (ret) {
+        dev_err_ratelimited(dev, "failed to read MMC command: %d\n", ret);
+        return;
+    }
+    if (!(req & MB_MMC_CMD_SHUTDOWN))
+        return;
+
+    dev_warn(dev, "MMC requests shutdown (%s)\n", mmc_mb_cmd_names[policy]);
+
+    switch (policy) {
+    case MMC_MB_CMD_POWEROFF:
+        orderly_poweroff(false);
+        break;
+    case MMC_MB_CMD_UEVENT:
+        kobject_uevent_env(&dev->kobj, KOBJ_CHANGE, envp);
+        break;
+    case MMC_MB_CMD_IGNORE:
+        break;
+    }
+}
+
+static irqreturn_t mmc_mb_doorbell_irq(int irq, void* data)
+{
+    struct at24_data* mmc_mailbox = data;
+    unsigned int i;
+
+    mutex_lock(&mmc_mailbox->lock);
+    for (i = 0; i < mmc_mailbox->num_regions; i++)
+        if (mmc_mailbox->regions[i].type == MMC_MB_REGION_MMC)
+            mmc_mailbox->regions[i].stamp = 0;
+    memset(mmc_mailbox->fills, 0, sizeof(mmc_mailbox->fills));
+    mmc_mb_snapshot_replace(mmc_mailbox, NULL);
+    mmc_mb_watch_refresh(mmc_mailbox);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    mmc_mb_notify(mmc_mailbox, true);
+    mmc_mb_command_check(mmc_mailbox);
+
+    return IRQ_HANDLED;
+}
+
+/* The doorbell is an optional "doorbell-gpios" line, asserted on updates */
+static int mmc_mb_init_doorbell(struct at24_data* mmc_mailbox)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    struct gpio_desc* gpio;
+    unsigned long flags;
+    int irq;
+
+    gpio = devm_gpiod_get_optional(dev, "doorbell", GPIOD_IN);
+    if (IS_ERR(gpio))
+        return dev_err_probe(dev, PTR_ERR(gpio), "failed to get doorbell GPIO\n");
+    if (!gpio)
+        return 0;
+
+    irq = gpiod_to_irq(gpio);
+    if (irq < 0)
+        return dev_err_probe(dev, irq, "doorbell GPIO has no interrupt\n");
+
+    flags = IRQF_ONESHOT;
+    flags |= gpiod_is_active_low(gpio) ? IRQF_TRIGGER_FALLING : IRQF_TRIGGER_RISING;
+
+    mmc_mailbox->doorbell = gpio;
+
+    return devm_request_threaded_irq(dev,
+                                     irq,
+                                     NULL,
+                                     mmc_mb_doorbell_irq,
+                                     flags,
+                                     dev_name(dev),
+                                     mmc_mailbox);
+}
+
+/*
+ * Change poller: without a doorbell, a timer checks a small window for
+ * changes, by default the generation counter or else all MMC regions. Only
+ * when its checksum changes are the MMC regions fetched and the waiters
+ * notified. The interval doubles up to poll_max_ms while nothing changes
+ * and drops back to poll_min_ms after a change. poll_min_ms == 0 stops it.
+ */
+
+/* [lo, hi) of all MMC regions, empty if there are none */
+static void mmc_mb_mmc_span(struct at24_data* mmc_mailbox, unsigned int* lo, unsigned int* hi)
+{
+    unsigned int i;
+
+    *lo = mmc_mailbox->byte_len;
+    *hi = 0;
+    for (i = 0; i < mmc_mailbox->num_regions; i++) {
+        if (mmc_mailbox->regions[i].type != MMC_MB_REGION_MMC)
+            continue;
+        *lo = min(*lo, mmc_mailbox->regions[i].start);
+        *hi = max(*hi, mmc_mailbox->regions[i].end);
+    }
+}
+
+/* Returns 1 if the window changed, must hold lock */
+static int mmc_mb_poll_check(struct at24_data* mmc_mailbox)
+{
+    unsigned int lo, hi, end, start;
+    u32 digest;
+    int ret;
+
+    ret = mmc_mb_shadow_fill(mmc_mailbox, mmc_mailbox->poll_off, mmc_mailbox->poll_len);
+    if (ret)
+        return ret;
+
+    digest = crc32(~0, mmc_mailbox->shadow + mmc_mailbox->poll_off, mmc_mailbox->poll_len);
+
+    /* The command byte has to be watched even if it is outside the window */
+    if (mmc_mailbox->cmd_valid &&
+        (mmc_mailbox->cmd_offs < mmc_mailbox->poll_off ||
+         mmc_mailbox->cmd_offs >= mmc_mailbox->poll_off + mmc_mailbox->poll_len)) {
+        ret = mmc_mb_shadow_fill(mmc_mailbox, mmc_mailbox->cmd_offs, 1);
+        if (ret)
+            return ret;
+        digest = crc32(digest, mmc_mailbox->shadow + mmc_mailbox->cmd_offs, 1);
+    }
+    if (digest == mmc_mailbox->poll_digest && mmc_mailbox->poll_primed)
+        return 0;
+    mmc_mailbox->poll_digest = digest;
+
+    /* The first poll only learns the initial checksum */
+    if (!mmc_mailbox->poll_primed) {
+        mmc_mailbox->poll_primed = true;
+        return 0;
+    }
+
+    /*
+     * Fetch the MMC regions, except for those the window has just read.
+     * Regions the window only partly covers are read again as a whole.
+     */
+    mmc_mb_mmc_span(mmc_mailbox, &lo, &hi);
+    end = clamp(mmc_mailbox->poll_off, lo, hi);
+    if (end < hi && mmc_mb_region_at(mmc_mailbox, end)->start < end)
+        end = min(hi, mmc_mb_region_at(mmc_mailbox, end)->end);
+    start = clamp(mmc_mailbox->poll_off + mmc_mailbox->poll_len, lo, hi);
+    if (start < hi && mmc_mb_region_at(mmc_mailbox, start)->start < start)
+        start = max(lo, mmc_mb_region_at(mmc_mailbox, start)->start);
+
+    if (lo < end) {
+        ret = mmc_mb_shadow_fill(mmc_mailbox, lo, end - lo);
+        if (ret)
+            return ret;
+    }
+    if (start < hi) {
+        ret = mmc_mb_shadow_fill(mmc_mailbox, start, hi - start);
+        if (ret)
+            return ret;
+    }
+    mmc_mb_watch_refresh(mmc_mailbox);
+    mmc_mb_snapshot_replace(mmc_mailbox, NULL);
+    mmc_mailbox->poll_changes++;
+
+    return 1;
+}
+
+static void mmc_mb_poll_work(struct work_struct* work)
+{
+    struct at24_data* mmc_mailbox = container_of(work, struct at24_data, poll_work);
+    struct device* dev = &mmc_mailbox->client->dev;
+    int ret;
+
+    ret = pm_runtime_get_sync(dev);
+    if (ret >= 0) {
+        mutex_lock(&mmc_mailbox->lock);
+        ret = mmc_mb_poll_check(mmc_mailbox);
+        mutex_unlock(&mmc_mailbox->lock);
+        pm_runtime_put(dev);
+    } else {
+        pm_runtime_put_noidle(dev);
+    }
+
+    if (ret > 0) {
+        mmc_mb_notify(mmc_mailbox, false);
+        mmc_mb_command_check(mmc_mailbox);
+    } else if (ret < 0)
+        dev_dbg_ratelimited(dev, "poll failed: %d\n", ret);
+
+    mutex_lock(&mmc_mailbox->lock);
+    if (ret > 0)
+        mmc_mailbox->poll_cur_ms = mmc_mailbox->poll_min_ms;
+    else
+        mmc_mailbox->poll_cur_ms = min(mmc_mailbox->poll_cur_ms * 2, mmc_mailbox->poll_max_ms);
+    if (mmc_mailbox->poll_min_ms && !mmc_mailbox->poll_stopped)
+        hrtimer_start(&mmc_mailbox->poll_timer,
+                      ms_to_ktime(mmc_mailbox->poll_cur_ms),
+                      HRTIMER_MODE_REL);
+    mutex_unlock(&mmc_mailbox->lock);
+}
+
+static enum hrtimer_restart mmc_mb_poll_timer(struct hrtimer* timer)
+{
+    struct at24_data* mmc_mailbox = container_of(timer, struct at24_data, poll_timer);
+
+    schedule_work(&mmc_mailbox->poll_work);
+
+    return HRTIMER_NORESTART;
+}
+
+/* (Re)start the poller with new bounds, must hold lock */
+static void mmc_mb_poll_set(struct at24_data* mmc_mailbox, unsigned int min_ms, unsigned int max_ms)
+{
+    mmc_mailbox->poll_min_ms = min_ms;
+    mmc_mailbox->poll_max_ms = max(min_ms, max_ms);
+    mmc_mailbox->poll_cur_ms = min_ms;
+
+    /* The timer only queues poll_work, which does not rearm it after this */
+    if (min_ms && !mmc_mailbox->poll_stopped)
+        hrtimer_start(&mmc_mailbox->poll_timer, ms_to_ktime(min_ms), HRTIMER_MODE_REL);
+    else
+        hrtimer_cancel(&mmc_mailbox->poll_timer);
+}
+
+static void mmc_mb_poll_stop(void* data)
+{
+    struct at24_data* mmc_mailbox = data;
+
+    mutex_lock(&mmc_mailbox->lock);
+    mmc_mailbox->poll_stopped = true;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    hrtimer_cancel(&mmc_mailbox->poll_timer);
+    cancel_work_sync(&mmc_mailbox->poll_work);
+}
+
+/*
+ * "desy,poll-ms" = <min max> enables the poller, "desy,poll-window" =
+ * <offset length> selects what it watches.
+ */
+static int mmc_mb_init_poll(struct at24_data* mmc_mailbox)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    u32 bounds[2] = {}, window[2];
+    unsigned int lo, hi;
+
+    hrtimer_init(&mmc_mailbox->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    mmc_mailbox->poll_timer.function = mmc_mb_poll_timer;
+    INIT_WORK(&mmc_mailbox->poll_work, mmc_mb_poll_work);
+
+    if (!device_property_read_u32_array(dev, "desy,poll-window", window, 2)) {
+        if (!window[1] || window[0] >= mmc_mailbox->byte_len ||
+            window[1] > mmc_mailbox->byte_len - window[0]) {
+            dev_err(dev, "invalid poll window\n");
+            return -EINVAL;
+        }
+        mmc_mailbox->poll_off = window[0];
+        mmc_mailbox->poll_len = window[1];
+    } else if (mmc_mailbox->gen_valid) {
+        mmc_mailbox->poll_off = mmc_mailbox->gen_offs;
+        mmc_mailbox->poll_len = 1;
+    } else {
+        mmc_mb_mmc_span(mmc_mailbox, &lo, &hi);
+        if (lo < hi) {
+            mmc_mailbox->poll_off = lo;
+            mmc_mailbox->poll_len = hi - lo;
+        } else if (mmc_mailbox->cmd_valid) {
+            mmc_mailbox->poll_off = mmc_mailbox->cmd_offs;
+            mmc_mailbox->poll_len = 1;
+        }
+    }
+
+    /* The doorbell makes polling unnecessary */
+    if (mmc_mailbox->doorbell)
+        mmc_mailbox->poll_stopped = true;
+    else
+        device_property_read_u32_array(dev, "desy,poll-ms", bounds, 2);
+
+    /* Polling the whole mailbox would cost more than it saves */
+    if (bounds[0] && !mmc_mailbox->poll_len) {
+        dev_warn(dev, "poller needs a generation counter, poll window or MMC region\n");
+        bounds[0] = 0;
+    }
+
+    mmc_mb_poll_set(mmc_mailbox, bounds[0], bounds[1]);
+
+    if (mmc_mailbox->cmd_valid && !mmc_mailbox->doorbell && !bounds[0])
+        dev_warn(dev, "MMC commands are ignored without a doorbell or desy,poll-ms\n");
+
+    return devm_add_action_or_reset(dev, mmc_mb_poll_stop, mmc_mailbox);
+}
+
+static DEFINE_IDA(mmc_mb_ida);
+
+static void mmc_mb_free(struct kref* kref)
+{
+    kfree(container_of(kref, struct at24_data, refs));
+}
+
+static void mmc_mb_put(void* data)
+{
+    struct at24_data* mmc_mailbox = data;
+
+    kref_put(&mmc_mailbox->refs, mmc_mb_free);
+}
+
+/* NULL once the device is unbound, otherwise mmc_mb_file_put() it when done */
+static struct at24_data* mmc_mb_file_get(struct mmc_mb_file* ctx)
+{
+    struct at24_data* mmc_mailbox = ctx->mmc_mailbox;
+
+    down_read(&mmc_mailbox->unbind_sem);
+    if (mmc_mailbox->dead) {
+        up_read(&mmc_mailbox->unbind_sem);
+        return NULL;
+    }
+
+    return mmc_mailbox;
+}
+
+static void mmc_mb_file_put(struct at24_data* mmc_mailbox)
+{
+    up_read(&mmc_mailbox->unbind_sem);
+}
+
+/* Check all segments up front, so a batch either runs completely or not at all */
+static int mmc_mb_batch_check(struct at24_data* mmc_mailbox,
+                              const struct mmc_mb_seg* segs,
+                              unsigned int num,
+                              size_t* total)
+{
+    unsigned int i;
+
+    *total = 0;
+    for (i = 0; i < num; i++) {
+        if (!segs[i].len || segs[i].offset >= mmc_mailbox->byte_len ||
+            segs[i].len > mmc_mailbox->byte_len - segs[i].offset)
+            return -EINVAL;
+        if ((segs[i].flags & ~MMC_MB_SEG_WRITE) || segs[i].reserved)
+            return -EINVAL;
+        if ((segs[i].flags & MMC_MB_SEG_WRITE) &&
+            !mmc_mb_writeable(mmc_mailbox, segs[i].offset, segs[i].len))
+            return -EACCES;
+        *total += segs[i].len;
+    }
+
+    return 0;
+}
+
+/* Run a batch within one session and one runtime PM reference */
+static int mmc_mb_batch_run(struct at24_data* mmc_mailbox,
+                            const struct mmc_mb_seg* segs,
+                            unsigned int num,
+                            u8* data)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    unsigned int i, lo, hi;
+    size_t total = 0;
+    int ret;
+
+    ret = wait_for_completion_killable(&mmc_mailbox->ready);
+    if (ret)
+        return ret;
+
+    ret = pm_runtime_get_sync(dev);
+    if (ret < 0) {
+        pm_runtime_put_noidle(dev);
+        return ret;
+    }
+
+    /* A batch is one session, so it is never split */
+    for (i = 0; i < num; i++)
+        total += segs[i].len;
+
+    mmc_mb_lock(mmc_mailbox, total);
+    mmc_mb_session_begin(mmc_mailbox);
+
+    for (i = 0, ret = 0; i < num && !ret; data += segs[i++].len) {
+        if (i)
+            mmc_mb_session_checkpoint(mmc_mailbox,
+                                      segs[i - 1].offset + segs[i - 1].len - 1,
+                                      segs[i].offset);
+
+        if (segs[i].flags & MMC_MB_SEG_WRITE) {
+            ret = mmc_mb_delta_write(mmc_mailbox, data, segs[i].offset, segs[i].len);
+            continue;
+        }
+
+        if (mmc_mb_shadow_span(mmc_mailbox, segs[i].offset, segs[i].len, &lo, &hi))
+            ret = mmc_mb_shadow_fill(mmc_mailbox, lo, hi - lo);
+        if (!ret)
+            memcpy(data, mmc_mailbox->shadow + segs[i].offset, segs[i].len);
+    }
+
+    mmc_mb_session_end(mmc_mailbox);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    pm_runtime_put(dev);
+
+    return ret;
+}
+
+/* Check a batch and copy in its write data, *data holds all segments */
+static int mmc_mb_batch_prep(struct at24_data* mmc_mailbox,
+                             const struct mmc_mb_seg* segs,
+                             unsigned int num,
+                             u8** data,
+                             size_t* total)
+{
+    unsigned int i;
+    u8* p;
+    int ret;
+
+    ret = mmc_mb_batch_check(mmc_mailbox, segs, num, total);
+    if (ret)
+        return ret;
+
+    *data = kmalloc(*total, GFP_KERNEL);
+    if (!*data)
+        return -ENOMEM;
+
+    for (i = 0, p = *data; i < num; p += segs[i++].len) {
+        if ((segs[i].flags & MMC_MB_SEG_WRITE) &&
+            copy_from_user(p, u64_to_user_ptr(segs[i].buf), segs[i].len)) {
+            kfree(*data);
+            return -EFAULT;
+        }
+    }
+
+    return 0;
+}
+
+/* Copy out the read data of a batch */
+static int mmc_mb_batch_finish(const struct mmc_mb_seg* segs, unsigned int num, const u8* data)
+{
+    unsigned int i;
+
+    for (i = 0; i < num; data += segs[i++].len) {
+        if (!(segs[i].flags & MMC_MB_SEG_WRITE) &&
+            copy_to_user(u64_to_user_ptr(segs[i].buf), data, segs[i].len))
+            return -EFAULT;
+    }
+
+    return 0;
+}
+
+static long mmc_mb_ioctl_batch(struct at24_data* mmc_mailbox, void __user* argp)
+{
+    struct mmc_mb_batch batch;
+    struct mmc_mb_seg* segs;
+    size_t total;
+    u8* data;
+    long ret;
+
+    if (copy_from_user(&batch, argp, sizeof(batch)))
+        return -EFAULT;
+
+    if (!batch.num_segs || batch.num_segs > MMC_MB_BATCH_MAX_SEGS || batch.flags)
+        return -EINVAL;
+
+    segs = memdup_user(u64_to_user_ptr(batch.segs), batch.num_segs * sizeof(*segs));
+    if (IS_ERR(segs))
+        return PTR_ERR(segs);
+
+    ret = mmc_mb_batch_prep(mmc_mailbox, segs, batch.num_segs, &data, &total);
+    if (ret)
+        goto out_segs;
+
+    ret = mmc_mb_batch_run(mmc_mailbox, segs, batch.num_segs, data);
+    if (!ret)
+        ret = mmc_mb_batch_finish(segs, batch.num_segs, data);
+
+    kfree(data);
+out_segs:
+    kfree(segs);
+    return ret;
+}
+
+/*
+ * io_uring passthrough: commands are checked and their write data copied
+ * in at submission, then run in order on the device's ordered workqueue.
+ * Read data is copied out in the submitter's task context.
+ */
+struct mmc_mb_uring_req {
+    struct work_struct work;
+    struct io_uring_cmd* ioucmd;
+    struct at24_data* mmc_mailbox;
+    struct mmc_mb_seg seg;
+    struct mmc_mb_seg* segs;
+    unsigned int num;
+    u8* data;
+    size_t total;
+    int ret;
+};
+
+static struct mmc_mb_uring_req** mmc_mb_uring_pdu(struct io_uring_cmd* ioucmd)
+{
+    return (struct mmc_mb_uring_req**)ioucmd->pdu;
+}
+
+static void mmc_mb_uring_free(struct mmc_mb_uring_req* req)
+{
+    if (req->segs != &req->seg)
+        kfree(req->segs);
+    kfree(req->data);
+    kfree(req);
+}
+
+static void mmc_mb_uring_done(struct io_uring_cmd* ioucmd)
+{
+    struct mmc_mb_uring_req* req = *mmc_mb_uring_pdu(ioucmd);
+    ssize_t ret = req->ret;
+
+    if (!ret)
+        ret = mmc_mb_batch_finish(req->segs, req->num, req->data);
+    if (!ret)
+        ret = req->total;
+
+    mmc_mb_uring_free(req);
+    io_uring_cmd_done(ioucmd, ret, 0);
+}
+
+static void mmc_mb_uring_work(struct work_struct* work)
+{
+    struct mmc_mb_uring_req* req = container_of(work, struct mmc_mb_uring_req, work);
+    struct at24_data* mmc_mailbox = req->mmc_mailbox;
+
+    down_read(&mmc_mailbox->unbind_sem);
+    if (mmc_mailbox->dead)
+        req->ret = -ENODEV;
+    else
+        req->ret = mmc_mb_batch_run(mmc_mailbox, req->segs, req->num, req->data);
+    up_read(&mmc_mailbox->unbind_sem);
+
+    io_uring_cmd_complete_in_task(req->ioucmd, mmc_mb_uring_done);
+}
+
+static int mmc_mb_uring_cmd(struct io_uring_cmd* ioucmd, unsigned int issue_flags)
+{
+    struct mmc_mb_file* ctx = ioucmd->file->private_data;
+    const struct mmc_mb_uring_cmd* cmd = ioucmd->cmd;
+    struct at24_data* mmc_mailbox;
+    struct mmc_mb_uring_req* req;
+    u32 offset, len;
+    u64 addr;
+    int ret;
+
+    /* The command lives in the SQ ring, which userspace may still change */
+    addr = READ_ONCE(cmd->addr);
+    offset = READ_ONCE(cmd->offset);
+    len = READ_ONCE(cmd->len);
+
+    req = kzalloc(sizeof(*req), GFP_KERNEL);
+    if (!req)
+        return -ENOMEM;
+
+    /* Unbinding destroys uring_wq, so keep it from doing so until queued */
+    mmc_mailbox = mmc_mb_file_get(ctx);
+    if (!mmc_mailbox) {
+        kfree(req);
+        return -ENODEV;
+    }
+
+    req->ioucmd = ioucmd;
+    req->mmc_mailbox = mmc_mailbox;
+    req->segs = &req->seg;
+    req->num = 1;
+
+    switch (ioucmd->cmd_op) {
+    case MMC_MB_URING_CMD_WRITE:
+        req->seg.flags = MMC_MB_SEG_WRITE;
+        fallthrough;
+    case MMC_MB_URING_CMD_READ:
+        req->seg.offset = offset;
+        req->seg.len = len;
+        req->seg.buf = addr;
+        break;
+    case MMC_MB_URING_CMD_BATCH:
+        if (!len || len > MMC_MB_BATCH_MAX_SEGS || offset) {
+            ret = -EINVAL;
+            goto err;
+        }
+        req->segs = memdup_user(u64_to_user_ptr(addr), len * sizeof(*req->segs));
+        if (IS_ERR(req->segs)) {
+            ret = PTR_ERR(req->segs);
+            req->segs = NULL;
+            goto err;
+        }
+        req->num = len;
+        break;
+    default:
+        ret = -ENOTTY;
+        goto err;
+    }
+
+    ret = mmc_mb_batch_prep(req->mmc_mailbox, req->segs, req->num, &req->data, &req->total);
+    if (ret) {
+        req->data = NULL;
+        goto err;
+    }
+
+    *mmc_mb_uring_pdu(ioucmd) = req;
+    INIT_WORK(&req->work, mmc_mb_uring_work);
+    queue_work(mmc_mailbox->uring_wq, &req->work);
+    mmc_mb_file_put(mmc_mailbox);
+
+    return -EIOCBQUEUED;
+
+err:
+    mmc_mb_file_put(mmc_mailbox);
+    mmc_mb_uring_free(req);
+    return ret;
+}
+
+/* Replace the watched ranges of a file, none stops watching */
+static long mmc_mb_ioctl_watch(struct mmc_mb_file* ctx, void __user* argp)
+{
+    struct at24_data* mmc_mailbox = ctx->mmc_mailbox;
+    struct mmc_mb_range ranges[MMC_MB_WATCH_MAX_RANGES];
+    struct mmc_mb_watch watch;
+    unsigned int i;
+
+    if (copy_from_user(&watch, argp, sizeof(watch)))
+        return -EFAULT;
+
+    if (watch.num_ranges > MMC_MB_WATCH_MAX_RANGES || watch.flags)
+        return -EINVAL;
+
+    if (copy_from_user(ranges, u64_to_user_ptr(watch.ranges), watch.num_ranges * sizeof(*ranges)))
+        return -EFAULT;
+
+    for (i = 0; i < watch.num_ranges; i++)
+        if (!ranges[i].len || ranges[i].offset >= mmc_mailbox->byte_len ||
+            ranges[i].len > mmc_mailbox->byte_len - ranges[i].offset)
+            return -EINVAL;
+
+    mutex_lock(&mmc_mailbox->lock);
+    memcpy(ctx->watch, ranges, watch.num_ranges * sizeof(*ranges));
+    ctx->num_watch = watch.num_ranges;
+    WRITE_ONCE(ctx->changed, false);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return 0;
+}
+
+static long mmc_mb_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
+{
+    struct mmc_mb_file* ctx = file->private_data;
+    void __user* argp = (void __user*)arg;
+    struct at24_data* mmc_mailbox;
+    long ret;
+
+    mmc_mailbox = mmc_mb_file_get(ctx);
+    if (!mmc_mailbox)
+        return -ENODEV;
+
+    switch (cmd) {
+    case MMC_MB_IOC_BATCH:
+        /* A batch acknowledges the doorbell rings so far */
+        ctx->doorbell_seen = atomic_read(&mmc_mailbox->doorbell_count);
+        ret = mmc_mb_ioctl_batch(mmc_mailbox, argp);
+        break;
+    case MMC_MB_IOC_WATCH:
+        ret = mmc_mb_ioctl_watch(ctx, argp);
+        break;
+    default:
+        ret = -ENOTTY;
+        break;
+    }
+
+    mmc_mb_file_put(mmc_mailbox);
+
+    return ret;
+}
+
+static int mmc_mb_fsync(struct file* file, loff_t start, loff_t end, int datasync)
+{
+    struct at24_data* mmc_mailbox = mmc_mb_file_get(file->private_data);
+    int ret;
+
+    if (!mmc_mailbox)
+        return -ENODEV;
+
+    ret = mmc_mb_flush(mmc_mailbox);
+    mmc_mb_file_put(mmc_mailbox);
+
+    return ret;
+}
+
+/*
+ * EPOLLIN once a watched range changed since the last read() on this file,
+ * EPOLLPRI once the doorbell rang since the last batch.
+ */
+static __poll_t mmc_mb_poll(struct file* file, poll_table* wait)
+{
+    struct mmc_mb_file* ctx = file->private_data;
+    struct at24_data* mmc_mailbox = ctx->mmc_mailbox;
+    __poll_t mask = 0;
+
+    poll_wait(file, &mmc_mailbox->doorbell_wq, wait);
+
+    if (READ_ONCE(mmc_mailbox->dead))
+        return EPOLLERR | EPOLLHUP;
+
+    if (READ_ONCE(ctx->changed))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (atomic_read(&mmc_mailbox->doorbell_count) != ctx->doorbell_seen)
+        mask |= EPOLLPRI;
+
+    return mask;
+}
+
+/* Same semantics as the eeprom file, served from the cache where possible */
+static ssize_t mmc_mb_read(struct file* file, char __user* buf, size_t count, loff_t* ppos)
+{
+    struct mmc_mb_file* ctx = file->private_data;
+    struct at24_data* mmc_mailbox = ctx->mmc_mailbox;
+    loff_t pos = *ppos;
+    u8* data;
+    int ret;
+
+    if (pos < 0)
+        return -EINVAL;
+    if (pos >= mmc_mailbox->byte_len)
+        return 0;
+    count = min_t(size_t, count, mmc_mailbox->byte_len - pos);
+    if (!count)
+        return 0;
+
+    data = kmalloc(count, GFP_KERNEL);
+    if (!data)
+        return -ENOMEM;
+
+    /* Changes during the read make the file readable again */
+    WRITE_ONCE(ctx->changed, false);
+
+    if (mmc_mb_file_get(ctx)) {
+        ret = at24_read(mmc_mailbox, pos, data, count);
+        mmc_mb_file_put(mmc_mailbox);
+    } else {
+        ret = -ENODEV;
+    }
+    if (!ret && copy_to_user(buf, data, count))
+        ret = -EFAULT;
+    kfree(data);
+    if (ret)
+        return ret;
+
+    *ppos = pos + count;
+
+    return count;
+}
+
+/* Read-only, see struct mmc_mb_mmap_hdr */
+static int mmc_mb_mmap(struct file* file, struct vm_area_struct* vma)
+{
+    struct at24_data* mmc_mailbox;
+    int ret;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+    /* The pages stay mapped after unbinding, but are not updated anymore */
+    mmc_mailbox = mmc_mb_file_get(file->private_data);
+    if (!mmc_mailbox)
+        return -ENODEV;
+
+    ret = remap_vmalloc_range(vma, mmc_mailbox->mmap_hdr, vma->vm_pgoff);
+    mmc_mb_file_put(mmc_mailbox);
+
+    return ret;
+}
+
+static loff_t mmc_mb_llseek(struct file* file, loff_t offset, int whence)
+{
+    struct mmc_mb_file* ctx = file->private_data;
+
+    return fixed_size_llseek(file, offset, whence, ctx->mmc_mailbox->byte_len);
+}
+
+/* misc_open() sets private_data to our miscdevice, replace it by our context */
+static int mmc_mb_open(struct inode* inode, struct file* file)
+{
+    struct miscdevice* misc = file->private_data;
+    struct at24_data* mmc_mailbox;
+    struct mmc_mb_file* ctx;
+
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+        return -ENOMEM;
+
+    /* Runs under the misc device lock, so unbinding cannot be in progress */
+    mmc_mailbox = container_of(misc, struct at24_data, misc);
+    kref_get(&mmc_mailbox->refs);
+    ctx->mmc_mailbox = mmc_mailbox;
+    ctx->doorbell_seen = atomic_read(&mmc_mailbox->doorbell_count);
+    file->private_data = ctx;
+
+    mutex_lock(&mmc_mailbox->lock);
+    list_add(&ctx->node, &mmc_mailbox->files);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return 0;
+}
+
+static int mmc_mb_release(struct inode* inode, struct file* file)
+{
+    struct mmc_mb_file* ctx = file->private_data;
+    struct at24_data* mmc_mailbox = ctx->mmc_mailbox;
+
+    mutex_lock(&mmc_mailbox->lock);
+    list_del(&ctx->node);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    kfree(ctx);
+    mmc_mb_put(mmc_mailbox);
+
+    return 0;
+}
+
+static const struct file_operations mmc_mb_fops = {
+    .owner = THIS_MODULE,
+    .open = mmc_mb_open,
+    .release = mmc_mb_release,
+    .read = mmc_mb_read,
+    .llseek = mmc_mb_llseek,
+    .mmap = mmc_mb_mmap,
+    .uring_cmd = mmc_mb_uring_cmd,
+    .poll = mmc_mb_poll,
+    .fsync = mmc_mb_fsync,
+    .unlocked_ioctl = mmc_mb_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+static void mmc_mb_misc_release(void* data)
+{
+    struct at24_data* mmc_mailbox = data;
+
+    misc_deregister(&mmc_mailbox->misc);
+
+    /* Nothing may wait for a prefill that will never run */
+    complete_all(&mmc_mailbox->ready);
+
+    down_write(&mmc_mailbox->unbind_sem);
+    mmc_mailbox->dead = true;
+    up_write(&mmc_mailbox->unbind_sem);
+    wake_up_interruptible(&mmc_mailbox->doorbell_wq);
+
+    destroy_workqueue(mmc_mailbox->uring_wq);
+    ida_free(&mmc_mb_ida, mmc_mailbox->id);
+}
+
+static int mmc_mb_misc_register(struct at24_data* mmc_mailbox)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    int err;
+
+    mmc_mailbox->id = ida_alloc(&mmc_mb_ida, GFP_KERNEL);
+    if (mmc_mailbox->id < 0)
+        return mmc_mailbox->id;
+
+    snprintf(mmc_mailbox->misc_name,
+             sizeof(mmc_mailbox->misc_name),
+             "mmc-mailbox%d",
+             mmc_mailbox->id);
+    mmc_mailbox->misc.minor = MISC_DYNAMIC_MINOR;
+    mmc_mailbox->misc.name = mmc_mailbox->misc_name;
+    mmc_mailbox->misc.fops = &mmc_mb_fops;
+    mmc_mailbox->misc.parent = dev;
+
+    mmc_mailbox->uring_wq = alloc_ordered_workqueue("%s", 0, mmc_mailbox->misc_name);
+    if (!mmc_mailbox->uring_wq) {
+        ida_free(&mmc_mb_ida, mmc_mailbox->id);
+        return -ENOMEM;
+    }
+
+    err = misc_register(&mmc_mailbox->misc);
+    if (err) {
+        destroy_workqueue(mmc_mailbox->uring_wq);
+        ida_free(&mmc_mb_ida, mmc_mailbox->id);
+        return err;
+    }
+
+    return devm_add_action_or_reset(dev, mmc_mb_misc_release, mmc_mailbox);
+}
+
+/*
+ * sysfs attributes
+ */
+
+static ssize_t delta_bytes_saved_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    u64 saved;
+
+    mutex_lock(&mmc_mailbox->lock);
+    saved = mmc_mailbox->delta_saved;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return sysfs_emit(buf, "%llu\n", saved);
+}
+static DEVICE_ATTR_RO(delta_bytes_saved);
+
+/* Reads served by another reader's bus transfer */
+static ssize_t merged_reads_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    u64 merged;
+
+    mutex_lock(&mmc_mailbox->lock);
+    merged = mmc_mailbox->merged_reads;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return sysfs_emit(buf, "%llu\n", merged);
+}
+static DEVICE_ATTR_RO(merged_reads);
+
+/* How often bulk reads let urgent accesses go first */
+static ssize_t bulk_yields_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    u64 yields;
+
+    mutex_lock(&mmc_mailbox->lock);
+    yields = mmc_mailbox->bulk_yields;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return sysfs_emit(buf, "%llu\n", yields);
+}
+static DEVICE_ATTR_RO(bulk_yields);
+
+/* Number of doorbell rings, pollable */
+static ssize_t doorbell_count_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%d\n", atomic_read(&mmc_mailbox->doorbell_count));
+}
+static DEVICE_ATTR_RO(doorbell_count);
+
+/* "min max" poll interval bounds in ms, "0 0" stops the poller */
+static ssize_t poll_ms_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    ssize_t ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    ret = sysfs_emit(buf, "%u %u\n", mmc_mailbox->poll_min_ms, mmc_mailbox->poll_max_ms);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return ret;
+}
+
+static ssize_t poll_ms_store(struct device* dev,
+                             struct device_attribute* attr,
+                             const char* buf,
+                             size_t count)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    unsigned int min_ms, max_ms;
+
+    if (sscanf(buf, "%u %u", &min_ms, &max_ms) != 2)
+        return -EINVAL;
+    if (max_ms > 60 * MSEC_PER_SEC || (min_ms && mmc_mailbox->doorbell))
+        return -EINVAL;
+    if (min_ms && !mmc_mailbox->poll_len)
+        return -EINVAL;
+
+    mutex_lock(&mmc_mailbox->lock);
+    mmc_mb_poll_set(mmc_mailbox, min_ms, max_ms);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(poll_ms);
+
+/* Changes found by the poller */
+static ssize_t poll_changes_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    u64 changes;
+
+    mutex_lock(&mmc_mailbox->lock);
+    changes = mmc_mailbox->poll_changes;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return sysfs_emit(buf, "%llu\n", changes);
+}
+static DEVICE_ATTR_RO(poll_changes);
+
+/* transfers, failed attempts, timeouts, current initial backoff (us) */
+static ssize_t retry_stats_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    ssize_t ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    ret = sysfs_emit(buf,
+                     "%llu %llu %llu %u\n",
+                     mmc_mailbox->retry_transfers,
+                     mmc_mailbox->retry_failures,
+                     mmc_mailbox->retry_timeouts,
+                     mmc_mailbox->retry_learned_us);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return ret;
+}
+static DEVICE_ATTR_RO(retry_stats);
+
+/* optimistic reads that succeeded, that fell back to a locked read */
+static ssize_t optimistic_stats_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    ssize_t ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    ret = sysfs_emit(buf,
+                     "%llu %llu\n",
+                     mmc_mailbox->optimistic_hits,
+                     mmc_mailbox->optimistic_fallbacks);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return ret;
+}
+static DEVICE_ATTR_RO(optimistic_stats);
+
+/*
+ * Runtime tunables. All of them are taken under lock, so they never change
+ * in the middle of an access.
+ */
+
+static int mmc_mb_store_uint(const char* buf,
+                             unsigned int min,
+                             unsigned int max,
+                             unsigned int* val)
+{
+    unsigned int v;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &v);
+    if (ret)
+        return ret;
+    if (v < min || v > max)
+        return -EINVAL;
+
+    *val = v;
+
+    return 0;
+}
+
+static ssize_t read_chunk_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(mmc_mailbox->read_max));
+}
+
+static ssize_t read_chunk_store(struct device* dev,
+                                struct device_attribute* attr,
+                                const char* buf,
+                                size_t count)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    unsigned int val;
+    int ret;
+
+    ret = mmc_mb_store_uint(buf, 1, mmc_mailbox->read_limit, &val);
+    if (ret)
+        return ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    mmc_mailbox->read_max = val;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(read_chunk);
+
+static ssize_t write_chunk_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(mmc_mailbox->write_max));
+}
+
+static ssize_t write_chunk_store(struct device* dev,
+                                 struct device_attribute* attr,
+                                 const char* buf,
+                                 size_t count)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    unsigned int val;
+    int ret;
+
+    ret = mmc_mb_store_uint(buf, 1, mmc_mailbox->write_limit, &val);
+    if (ret)
+        return ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    mmc_mailbox->write_max = val;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(write_chunk);
+
+/* Setting the budget recalculates both chunk sizes */
+static ssize_t hold_budget_us_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(mmc_mailbox->hold_budget_us));
+}
+
+static ssize_t hold_budget_us_store(struct device* dev,
+                                    struct device_attribute* attr,
+                                    const char* buf,
+                                    size_t count)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    unsigned int val;
+    int ret;
+
+    ret = mmc_mb_store_uint(buf, 1, USEC_PER_SEC, &val);
+    if (ret)
+        return ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    mmc_mb_set_hold_budget(mmc_mailbox, val);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(hold_budget_us);
+
+/* Estimated at probe, 0 if the calibration failed */
+static ssize_t bus_khz_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    unsigned int khz = 0;
+
+    /* 9 clocks per byte */
+    if (mmc_mailbox->byte_ns)
+        khz = 9 * NSEC_PER_MSEC / mmc_mailbox->byte_ns;
+
+    return sysfs_emit(buf, "%u\n", khz);
+}
+static DEVICE_ATTR_RO(bus_khz);
+
+/* All policies, the active one in brackets */
+static ssize_t retry_policy_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    enum mmc_mb_retry_policy policy = READ_ONCE(mmc_mailbox->retry_policy);
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(mmc_mb_retry_names); i++)
+        len += sysfs_emit_at(buf,
+                             len,
+                             i == policy ? "[%s] " : "%s ",
+                             mmc_mb_retry_names[i]);
+    buf[len - 1] = '\n';
+
+    return len;
+}
+
+static ssize_t retry_policy_store(struct device* dev,
+                                  struct device_attribute* attr,
+                                  const char* buf,
+                                  size_t count)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    int ret;
+
+    ret = sysfs_match_string(mmc_mb_retry_names, buf);
+    if (ret < 0)
+        return ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    mmc_mailbox->retry_policy = ret;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(retry_policy);
+
+static ssize_t command_policy_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    enum mmc_mb_cmd_policy policy = READ_ONCE(mmc_mailbox->cmd_policy);
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(mmc_mb_cmd_names); i++)
+        len += sysfs_emit_at(buf,
+                             len,
+                             i == policy ? "[%s] " : "%s ",
+                             mmc_mb_cmd_names[i]);
+    buf[len - 1] = '\n';
+
+    return len;
+}
+
+static ssize_t command_policy_store(struct device* dev,
+                                    struct device_attribute* attr,
+                                    const char* buf,
+                                    size_t count)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    int ret;
+
+    ret = sysfs_match_string(mmc_mb_cmd_names, buf);
+    if (ret < 0)
+        return ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    mmc_mailbox->cmd_policy = ret;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(command_policy);
+
+static ssize_t timeout_ms_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(mmc_mailbox->timeout_ms));
+}
+
+static ssize_t timeout_ms_store(struct device* dev,
+                                struct device_attribute* attr,
+                                const char* buf,
+                                size_t count)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    unsigned int val;
+    int ret;
+
+    ret = mmc_mb_store_uint(buf, 1, MSEC_PER_SEC, &val);
+    if (ret)
+        return ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    mmc_mailbox->timeout_ms = val;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(timeout_ms);
+
+/* Lock flag budget of sessions, 0 for unlimited */
+static ssize_t lock_budget_us_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(mmc_mailbox->lock_budget_us));
+}
+
+static ssize_t lock_budget_us_store(struct device* dev,
+                                    struct device_attribute* attr,
+                                    const char* buf,
+                                    size_t count)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    unsigned int val;
+    int ret;
+
+    ret = mmc_mb_store_uint(buf, 0, USEC_PER_SEC, &val);
+    if (ret)
+        return ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    mmc_mailbox->lock_budget_us = val;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(lock_budget_us);
+
+/*
+ * Lock flag hold times, one "<upper bound in us> <count>" line per bucket.
+ * Writing 0 clears it, along with lock_stats.
+ */
+static ssize_t lock_hold_hist_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    int i;
+
+    mutex_lock(&mmc_mailbox->lock);
+    for (i = 0; i < MMC_MB_LOCK_HIST_BUCKETS - 1; i++)
+        len += sysfs_emit_at(buf, len, "%lu %u\n", BIT(i), mmc_mailbox->lock_hist[i]);
+    len += sysfs_emit_at(buf, len, "inf %u\n", mmc_mailbox->lock_hist[i]);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return len;
+}
+
+static ssize_t lock_hold_hist_store(struct device* dev,
+                                    struct device_attribute* attr,
+                                    const char* buf,
+                                    size_t count)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    unsigned int val;
+    int ret;
+
+    ret = mmc_mb_store_uint(buf, 0, 0, &val);
+    if (ret)
+        return ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    memset(mmc_mailbox->lock_hist, 0, sizeof(mmc_mailbox->lock_hist));
+    mmc_mailbox->lock_hold_max_us = 0;
+    mmc_mailbox->lock_splits = 0;
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(lock_hold_hist);
+
+/* longest lock flag hold time (us), sessions split by the budget */
+static ssize_t lock_stats_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    ssize_t ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    ret = sysfs_emit(buf, "%u %llu\n", mmc_mailbox->lock_hold_max_us, mmc_mailbox->lock_splits);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return ret;
+}
+static DEVICE_ATTR_RO(lock_stats);
+
+/* 0 disables snapshot mode and drops the current snapshot */
+static ssize_t snapshot_ms_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(mmc_mailbox->snapshot_ms));
+}
+
+static ssize_t snapshot_ms_store(struct device* dev,
+                                 struct device_attribute* attr,
+                                 const char* buf,
+                                 size_t count)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    unsigned int val;
+    int ret;
+
+    ret = mmc_mb_store_uint(buf, 0, 60 * MSEC_PER_SEC, &val);
+    if (ret)
+        return ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    WRITE_ONCE(mmc_mailbox->snapshot_ms, val);
+    if (!val)
+        mmc_mb_snapshot_replace(mmc_mailbox, NULL);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(snapshot_ms);
+
+/* Version and age (ms) of the current snapshot, nothing if there is none */
+static ssize_t snapshot_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    struct mmc_mb_snapshot* snap;
+    ssize_t ret = 0;
+
+    rcu_read_lock();
+    snap = rcu_dereference(mmc_mailbox->snapshot);
+    if (snap)
+        ret = sysfs_emit(buf,
+                         "%llu %lld\n",
+                         snap->version,
+                         ktime_ms_delta(ktime_get(), snap->stamp));
+    rcu_read_unlock();
+
+    return ret;
+}
+static DEVICE_ATTR_RO(snapshot);
+
+/*
+ * 0 switches back to write-through; pending writes are flushed right away.
+ * A new delay applies from the next write on.
+ */
+static ssize_t writeback_ms_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(mmc_mailbox->writeback_ms));
+}
+
+static ssize_t writeback_ms_store(struct device* dev,
+                                  struct device_attribute* attr,
+                                  const char* buf,
+                                  size_t count)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+    unsigned int val;
+    int ret;
+
+    ret = mmc_mb_store_uint(buf, 0, 60 * MSEC_PER_SEC, &val);
+    if (ret)
+        return ret;
+
+    mutex_lock(&mmc_mailbox->lock);
+    WRITE_ONCE(mmc_mailbox->writeback_ms, val);
+    mutex_unlock(&mmc_mailbox->lock);
+
+    if (!val) {
+        mod_delayed_work(system_wq, &mmc_mailbox->flush_work, 0);
+        flush_delayed_work(&mmc_mailbox->flush_work);
+    }
+
+    return count;
+}
+static DEVICE_ATTR_RW(writeback_ms);
+
+static struct attribute* mmc_mb_attrs[] = {
+    &dev_attr_delta_bytes_saved.attr,
+    &dev_attr_merged_reads.attr,
+    &dev_attr_bulk_yields.attr,
+    &dev_attr_doorbell_count.attr,
+    &dev_attr_poll_ms.attr,
+    &dev_attr_poll_changes.attr,
+    &dev_attr_retry_stats.attr,
+    &dev_attr_optimistic_stats.attr,
+    &dev_attr_read_chunk.attr,
+    &dev_attr_write_chunk.attr,
+    &dev_attr_hold_budget_us.attr,
+    &dev_attr_bus_khz.attr,
+    &dev_attr_retry_policy.attr,
+    &dev_attr_command_policy.attr,
+    &dev_attr_timeout_ms.attr,
+    &dev_attr_writeback_ms.attr,
+    &dev_attr_snapshot_ms.attr,
+    &dev_attr_lock_budget_us.attr,
+    &dev_attr_lock_hold_hist.attr,
+    &dev_attr_lock_stats.attr,
+    &dev_attr_snapshot.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(mmc_mb);
+
+/*
+ * Power off runs with interrupts disabled and the other CPUs stopped, so
+ * neither regmap nor the retry helpers (which may sleep) can be used here.
+ * The handshake talks to the adapter's atomic transfer method directly:
+ * write SHDN_FINISHED with a few retries, read it back, then poll for the
+ * MMC to acknowledge (or for power to drop) instead of a fixed delay.
+ *
+ * Every mailbox registers a sys-off handler, but the first one to run
+ * signals all of them and waits for their acknowledges together, so boards
+ * with several MMCs do not pay the MMC reaction time once per mailbox.
+ */
+
+#define MMC_MB_PWROFF_TRIES 5
+#define MMC_MB_PWROFF_RETRY_US 200
+#define MMC_MB_PWROFF_POLL_US 500
+#define MMC_MB_PWROFF_TIMEOUT_MS 1000
+
+enum mmc_mb_pwroff_state {
+    MMC_MB_PWROFF_IDLE,
+    MMC_MB_PWROFF_WAITING,
+    MMC_MB_PWROFF_DONE,
+};
+
+/*
+ * Changed under mmc_mb_pwroff_mutex at probe and remove. The power off
+ * handler walks it without locking, nothing else runs at that point.
+ */
+static LIST_HEAD(mmc_mb_pwroff_list);
+static DEFINE_MUTEX(mmc_mb_pwroff_mutex);
+
+/*
+ * The I2C core only switches to atomic transfers once the system is going
+ * down, and in a panic the bus lock may be held by a CPU that was stopped
+ * in the middle of a transfer. Panic context therefore calls the adapter's
+ * atomic method directly, bypassing the lock.
+ */
+static int mmc_mb_atomic_xfer(struct at24_data* mmc_mailbox,
+                              struct i2c_msg* msgs,
+                              int num,
+                              bool panic)
+{
+    struct i2c_adapter* adap = mmc_mailbox->client->adapter;
+    int i, ret = -EIO;
+
+    if (panic && !adap->algo->master_xfer_atomic)
+        return -EOPNOTSUPP;
+
+    for (i = 0; i < MMC_MB_PWROFF_TRIES; i++) {
+        if (panic)
+            ret = adap->algo->master_xfer_atomic(adap, msgs, num);
+        else
+            ret = i2c_transfer(adap, msgs, num);
+        if (ret == num)
+            return 0;
+        udelay(MMC_MB_PWROFF_RETRY_US);
+    }
+
+    return ret < 0 ? ret : -EIO;
+}
+
+static int mmc_mb_pwroff_xfer(struct at24_data* mmc_mailbox, unsigned int off, u8* val, bool read)
+{
+    struct i2c_client* client = mmc_mailbox->client;
+    u8 buf[3] = {off >> 8, off & 0xff, *val};
+    struct i2c_msg msgs[2] = {
+        {.addr = client->addr, .flags = 0, .len = read ? 2 : 3, .buf = buf},
+        {.addr = client->addr, .flags = I2C_M_RD, .len = 1, .buf = val},
+    };
+
+    return mmc_mb_atomic_xfer(mmc_mailbox, msgs, read ? 2 : 1, false);
+}
+
+static int mmc_mb_status_send(struct at24_data* mmc_mailbox, u8 stat, bool panic)
+{
+    mmc_mailbox->status_buf[2] = stat;
+
+    return mmc_mb_atomic_xfer(mmc_mailbox, &mmc_mailbox->status_msg, 1, panic);
+}
+
+static bool mmc_mb_pwroff_acked(struct at24_data* mmc_mailbox)
+{
+    u8 val = 0;
+
+    if (mmc_mailbox->power_good && !gpiod_get_value(mmc_mailbox->power_good))
+        return true;
+
+    if (!mmc_mailbox->pwroff_ack_mask)
+        return false;
+
+    return !mmc_mb_pwroff_xfer(mmc_mailbox, mmc_mailbox->pwroff_ack_offs, &val, true) &&
+           (val & mmc_mailbox->pwroff_ack_mask) == mmc_mailbox->pwroff_ack_mask;
+}
+
+static int mmc_mb_pwroff_send(struct at24_data* mmc_mailbox)
+{
+    u8 stat = MB_FPGA_STATUS_SHDN_FINISHED;
+    u8 clear = 0;
+    int ret;
+
+    /* A session interrupted by the shutdown must not keep the MMC out */
+    mmc_mb_pwroff_xfer(mmc_mailbox, MB_LOCK_OFFS, &clear, false);
+
+    ret = mmc_mb_status_send(mmc_mailbox, stat, false);
+    if (ret)
+        return ret;
+
+    stat = 0;
+    ret = mmc_mb_pwroff_xfer(mmc_mailbox, MB_FPGA_STATUS_OFFS, &stat, true);
+    if (!ret && !(stat & MB_FPGA_STATUS_SHDN_FINISHED))
+        ret = -EIO;
+
+    return ret;
+}
+
+static void mmc_mb_pwroff_all(void)
+{
+    struct at24_data* mmc_mailbox;
+    unsigned int waiting = 0;
+    ktime_t start, now;
+    int ret;
+
+    start = ktime_get();
+    list_for_each_entry(mmc_mailbox, &mmc_mb_pwroff_list, pwroff_node) {
+        struct device* dev = &mmc_mailbox->client->dev;
+
+        if (mmc_mailbox->pwroff_state != MMC_MB_PWROFF_IDLE)
+            continue;
+
+        dev_info(dev, "Sending SHDN_FINISHED to MMC\n");
+        ret = mmc_mb_pwroff_send(mmc_mailbox);
+        if (ret) {
+            dev_emerg(dev, "failed to send SHDN_FINISHED: %d\n", ret);
+            mmc_mailbox->pwroff_state = MMC_MB_PWROFF_DONE;
+            continue;
+        }
+
+        /* Without an acknowledge there is nothing to wait for */
+        if (!mmc_mailbox->pwroff_ack_mask && !mmc_mailbox->power_good) {
+            mmc_mailbox->pwroff_state = MMC_MB_PWROFF_DONE;
+            continue;
+        }
+        mmc_mailbox->pwroff_state = MMC_MB_PWROFF_WAITING;
+        waiting++;
+    }
+
+    while (waiting) {
+        udelay(MMC_MB_PWROFF_POLL_US);
+        now = ktime_get();
+
+        list_for_each_entry(mmc_mailbox, &mmc_mb_pwroff_list, pwroff_node) {
+            struct device* dev = &mmc_mailbox->client->dev;
+            s64 us = ktime_us_delta(now, start);
+
+            if (mmc_mailbox->pwroff_state != MMC_MB_PWROFF_WAITING)
+                continue;
+
+            if (mmc_mb_pwroff_acked(mmc_mailbox))
+                dev_info(dev, "MMC acknowledged shutdown after %lld us\n", us);
+            else if (us >= mmc_mailbox->pwroff_timeout_ms * USEC_PER_MSEC)
+                dev_emerg(dev,
+                          "MMC did not power off within %u ms\n",
+                          mmc_mailbox->pwroff_timeout_ms);
+            else
+                continue;
+
+            mmc_mailbox->pwroff_state = MMC_MB_PWROFF_DONE;
+            waiting--;
+        }
+    }
+}
+
+static int mmc_mb_sys_off(struct sys_off_data* data)
+{
+    struct at24_data* mmc_mailbox = data->cb_data;
+
+    if (mmc_mailbox->pwroff_state == MMC_MB_PWROFF_IDLE)
+        mmc_mb_pwroff_all();
+
+    return NOTIFY_DONE;
+}
+
+/* Reboot and kexec: the MMC may prepare for the restart right away */
+static int mmc_mb_reboot_notify(struct notifier_block* nb, unsigned long action, void* data)
+{
+    struct at24_data* mmc_mailbox = container_of(nb, struct at24_data, reboot_nb);
+
+    if (action != SYS_RESTART)
+        return NOTIFY_DONE;
+
+    if (mmc_mb_status_send(mmc_mailbox, MB_FPGA_STATUS_REBOOTING, false))
+        dev_err(&mmc_mailbox->client->dev, "failed to send REBOOTING to MMC\n");
+
+    return NOTIFY_DONE;
+}
+
+/* Panic: the MMC can power cycle without waiting for its watchdog */
+static int mmc_mb_panic_notify(struct notifier_block* nb, unsigned long action, void* data)
+{
+    struct at24_data* mmc_mailbox = container_of(nb, struct at24_data, panic_nb);
+
+    mmc_mb_status_send(mmc_mailbox, MB_FPGA_STATUS_PANIC, true);
+
+    return NOTIFY_DONE;
+}
+
+static void mmc_mb_panic_release(void* data)
+{
+    struct at24_data* mmc_mailbox = data;
+
+    atomic_notifier_chain_unregister(&panic_notifier_list, &mmc_mailbox->panic_nb);
+}
+
+static void mmc_mb_pwroff_release(void* data)
+{
+    struct at24_data* mmc_mailbox = data;
+
+    mutex_lock(&mmc_mb_pwroff_mutex);
+    list_del(&mmc_mailbox->pwroff_node);
+    mutex_unlock(&mmc_mb_pwroff_mutex);
+}
+
+static int mmc_mb_init_pwroff(struct at24_data* mmc_mailbox)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    struct gpio_desc* gpio;
+    u32 ack[2];
+    int ret;
+
+    mmc_mailbox->pwroff_timeout_ms = MMC_MB_PWROFF_TIMEOUT_MS;
+    device_property_read_u32(dev, "desy,poweroff-timeout-ms", &mmc_mailbox->pwroff_timeout_ms);
+
+    if (!device_property_read_u32_array(dev, "desy,poweroff-ack", ack, ARRAY_SIZE(ack))) {
+        if (ack[0] >= mmc_mailbox->byte_len || !ack[1] || ack[1] > 0xff)
+            return dev_err_probe(dev, -EINVAL, "invalid desy,poweroff-ack\n");
+        mmc_mailbox->pwroff_ack_offs = ack[0];
+        mmc_mailbox->pwroff_ack_mask = ack[1];
+    }
+
+    gpio = devm_gpiod_get_optional(dev, "power-good", GPIOD_IN);
+    if (IS_ERR(gpio))
+        return dev_err_probe(dev, PTR_ERR(gpio), "failed to get power-good GPIO\n");
+    if (gpio && gpiod_cansleep(gpio))
+        return dev_err_probe(dev, -EINVAL, "power-good GPIO must not sleep\n");
+    mmc_mailbox->power_good = gpio;
+
+    mmc_mailbox->status_buf[0] = MB_FPGA_STATUS_OFFS >> 8;
+    mmc_mailbox->status_buf[1] = MB_FPGA_STATUS_OFFS & 0xff;
+    mmc_mailbox->status_msg.addr = mmc_mailbox->client->addr;
+    mmc_mailbox->status_msg.flags = 0;
+    mmc_mailbox->status_msg.len = sizeof(mmc_mailbox->status_buf);
+    mmc_mailbox->status_msg.buf = mmc_mailbox->status_buf;
+
+    mmc_mailbox->reboot_nb.notifier_call = mmc_mb_reboot_notify;
+    ret = devm_register_reboot_notifier(dev, &mmc_mailbox->reboot_nb);
+    if (ret)
+        return ret;
+
+    mmc_mailbox->panic_nb.notifier_call = mmc_mb_panic_notify;
+    atomic_notifier_chain_register(&panic_notifier_list, &mmc_mailbox->panic_nb);
+    ret = devm_add_action_or_reset(dev, mmc_mb_panic_release, mmc_mailbox);
+    if (ret)
+        return ret;
+
+    mutex_lock(&mmc_mb_pwroff_mutex);
+    list_add_tail(&mmc_mailbox->pwroff_node, &mmc_mb_pwroff_list);
+    mutex_unlock(&mmc_mb_pwroff_mutex);
+
+    ret = devm_add_action_or_reset(dev, mmc_mb_pwroff_release, mmc_mailbox);
+    if (ret)
+        return ret;
+
+    /* Ahead of the platform handlers that actually cut the power */
+    return devm_register_sys_off_handler(dev,
+                                         SYS_OFF_MODE_POWER_OFF,
+                                         SYS_OFF_PRIO_HIGH,
+                                         mmc_mb_sys_off,
+                                         mmc_mailbox);
+}
+
+static const struct at24_chip_data* at24_get_chip_data(struct device* dev)
+{
+    struct device_node* of_node = dev->of_node;
+    const struct at24_chip_data* cdata;
+    const struct i2c_device_id* id;
+
+    id = i2c_match_id(mmc_mailbox_ids, to_i2c_client(dev));
+
+    /*
+   * The I2C core allows OF nodes compatibles to match against the
+   * I2C device ID table as a fallback, so check not only if an OF
+   * node is present but also if it matches an OF device ID entry.
+   */
+    if (of_node && of_match_device(mmc_mailbox_of_match, dev))
+        cdata = of_device_get_match_data(dev);
+    else if (id)
+        cdata = (void*)id->driver_data;
+    else
+        cdata = NULL;
+
+    if (!cdata)
+        return ERR_PTR(-ENODEV);
+
+    return cdata;
+}
+
+static int mmc_mb_region_desc_cmp(const void* a, const void* b)
+{
+    const struct mmc_mb_region_desc* da = a;
+    const struct mmc_mb_region_desc* db = b;
+
+    if (da->start != db->start)
+        return da->start < db->start ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Build the region table from a list of descriptors, filling the gaps with
+ * shared regions so that the table covers the whole mailbox.
+ */
+static int mmc_mb_init_regions(struct at24_data* mmc_mailbox,
+                               struct mmc_mb_region_desc* sorted,
+                               unsigned int num)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    struct mmc_mb_region* r;
+    unsigned int i, pos = 0;
+
+    sort(sorted, num, sizeof(*sorted), mmc_mb_region_desc_cmp, NULL);
+
+    /* At most one gap in front of each region, plus one at the end */
+    r = devm_kcalloc(dev, 2 * num + 1, sizeof(*r), GFP_KERNEL);
+    if (!r)
+        return -ENOMEM;
+    mmc_mailbox->regions = r;
+
+    for (i = 0; i < num; i++) {
+        /* Devicetree values, so keep start + len from wrapping */
+        if (sorted[i].start > mmc_mailbox->byte_len ||
+            sorted[i].len > mmc_mailbox->byte_len - sorted[i].start) {
+            dev_warn(dev,
+                     "region %u+%u exceeds mailbox, ignored\n",
+                     sorted[i].start,
+                     sorted[i].len);
+            continue;
+        }
+        if (!sorted[i].len || sorted[i].start < pos) {
+            dev_err(dev, "invalid region %u+%u\n", sorted[i].start, sorted[i].len);
+            return -EINVAL;
+        }
+
+        if (sorted[i].start > pos) {
+            r->start = pos;
+            r->end = sorted[i].start;
+            r->type = MMC_MB_REGION_SHARED;
+            r->gap = true;
+            r++;
+        }
+
+        r->start = sorted[i].start;
+        r->end = sorted[i].start + sorted[i].len;
+        r->type = sorted[i].type;
+        r->max_age_ms = sorted[i].max_age_ms;
+        pos = r->end;
+        r++;
+    }
+
+    if (pos < mmc_mailbox->byte_len) {
+        r->start = pos;
+        r->end = mmc_mailbox->byte_len;
+        r->type = MMC_MB_REGION_SHARED;
+        r->gap = true;
+        r++;
     }
 
-    dev_info(&mmc_mb_pwroff_inst->client->dev, "Sending SHDN_FINISHED to MMC\n");
-    regmap_bulk_write(mmc_mb_pwroff_inst->regmap, MB_FPGA_STATUS_OFFS, &stat, sizeof(stat));
-    mdelay(1000);
+    mmc_mailbox->num_regions = r - mmc_mailbox->regions;
 
-    WARN_ON(1);
+    return 0;
 }
 
-static const struct at24_chip_data* at24_get_chip_data(struct device* dev)
+/*
+ * Append the regions listed in a devicetree property, each entry being
+ * <offset length> or <offset length max-age-ms> depending on cells.
+ */
+static int mmc_mb_read_region_prop(struct device* dev,
+                                   const char* propname,
+                                   unsigned int cells,
+                                   enum mmc_mb_region_type type,
+                                   struct mmc_mb_region_desc* descs,
+                                   unsigned int* num)
 {
-    struct device_node* of_node = dev->of_node;
-    const struct at24_chip_data* cdata;
-    const struct i2c_device_id* id;
+    unsigned int i, n;
+    u32* vals;
+    int ret;
 
-    id = i2c_match_id(mmc_mailbox_ids, to_i2c_client(dev));
+    ret = device_property_count_u32(dev, propname);
+    if (ret <= 0)
+        return 0;
 
-    /*
-   * The I2C core allows OF nodes compatibles to match against the
-   * I2C device ID table as a fallback, so check not only if an OF
-   * node is present but also if it matches an OF device ID entry.
-   */
-    if (of_node && of_match_device(mmc_mailbox_of_match, dev))
-        cdata = of_device_get_match_data(dev);
-    else if (id)
-        cdata = (void*)id->driver_data;
+    n = ret;
+    if (n % cells) {
+        dev_err(dev, "%s must have %u cells per entry\n", propname, cells);
+        return -EINVAL;
+    }
+
+    vals = kcalloc(n, sizeof(*vals), GFP_KERNEL);
+    if (!vals)
+        return -ENOMEM;
+
+    ret = device_property_read_u32_array(dev, propname, vals, n);
+    if (ret)
+        goto out;
+
+    for (i = 0; i < n; i += cells) {
+        descs[*num].start = vals[i];
+        descs[*num].len = vals[i + 1];
+        descs[*num].type = type;
+        descs[*num].max_age_ms = cells > 2 ? vals[i + 2] : 0;
+        (*num)++;
+    }
+
+out:
+    kfree(vals);
+    return ret;
+}
+
+/*
+ * The region table is the chip's built-in table, extended by the
+ * "desy,host-regions" (<offset length>) and "desy,mmc-regions"
+ * (<offset length max-age-ms>) devicetree properties. The generation
+ * counter and the command byte, if any, are control bytes.
+ */
+static int mmc_mb_get_regions(struct at24_data* mmc_mailbox, const struct at24_chip_data* cdata)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    struct mmc_mb_region_desc* descs;
+    unsigned int num = cdata->num_regions;
+    int host, mmc, err;
+
+    host = max(device_property_count_u32(dev, "desy,host-regions"), 0);
+    mmc = max(device_property_count_u32(dev, "desy,mmc-regions"), 0);
+
+    descs = kcalloc(num + host / 2 + mmc / 3 + 2, sizeof(*descs), GFP_KERNEL);
+    if (!descs)
+        return -ENOMEM;
+    memcpy(descs, cdata->regions, num * sizeof(*descs));
+
+    if (mmc_mailbox->gen_valid) {
+        descs[num].start = mmc_mailbox->gen_offs;
+        descs[num].len = 1;
+        descs[num].type = MMC_MB_REGION_CTRL;
+        num++;
+    }
+
+    if (mmc_mailbox->cmd_valid) {
+        descs[num].start = mmc_mailbox->cmd_offs;
+        descs[num].len = 1;
+        descs[num].type = MMC_MB_REGION_CTRL;
+        num++;
+    }
+
+    err = mmc_mb_read_region_prop(dev, "desy,host-regions", 2, MMC_MB_REGION_HOST, descs, &num);
+    if (!err)
+        err = mmc_mb_read_region_prop(dev, "desy,mmc-regions", 3, MMC_MB_REGION_MMC, descs, &num);
+    if (!err)
+        err = mmc_mb_init_regions(mmc_mailbox, descs, num);
+
+    kfree(descs);
+    return err;
+}
+
+/*
+ * regmap access callbacks: MMC regions are read-only for us. The lock byte
+ * is marked precious so that debugfs register dumps keep away from the lock
+ * handshake. regmap has no cache, the shadow is the driver's only cache.
+ */
+static struct mmc_mb_region* mmc_mb_reg_region(struct device* dev, unsigned int reg)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+
+    return mmc_mb_region_at(mmc_mailbox, reg);
+}
+
+static bool mmc_mb_readable_reg(struct device* dev, unsigned int reg)
+{
+    struct at24_data* mmc_mailbox = dev_get_drvdata(dev);
+
+    return reg < mmc_mailbox->byte_len;
+}
+
+static bool mmc_mb_writeable_reg(struct device* dev, unsigned int reg)
+{
+    return mmc_mb_readable_reg(dev, reg) && mmc_mb_reg_region(dev, reg)->type != MMC_MB_REGION_MMC;
+}
+
+static bool mmc_mb_precious_reg(struct device* dev, unsigned int reg)
+{
+    return reg == MB_LOCK_OFFS;
+}
+
+/*
+ * Combined transfers need repeated STARTs between arbitrary messages,
+ * adapters limited to write-then-read pairs can't do them.
+ */
+static int mmc_mb_init_comb(struct at24_data* mmc_mailbox, bool i2c_fn_i2c)
+{
+    const struct i2c_adapter_quirks* quirks = mmc_mailbox->client->adapter->quirks;
+    struct device* dev = &mmc_mailbox->client->dev;
+
+    mmc_mailbox->comb_max_msgs = MMC_MB_XFER_MAX_MSGS;
+    mmc_mailbox->comb_read_max = U16_MAX;
+    mmc_mailbox->comb_write_max = U16_MAX - 2;
+
+    if (quirks) {
+        if (quirks->flags & (I2C_AQ_COMB | I2C_AQ_NO_REP_START))
+            return 0;
+        if (quirks->max_num_msgs)
+            mmc_mailbox->comb_max_msgs =
+                min_t(unsigned int, quirks->max_num_msgs, MMC_MB_XFER_MAX_MSGS);
+        if (quirks->max_read_len)
+            mmc_mailbox->comb_read_max = quirks->max_read_len;
+        if (quirks->max_write_len > 2)
+            mmc_mailbox->comb_write_max = quirks->max_write_len - 2;
+        else if (quirks->max_write_len)
+            return 0;
+    }
+
+    /* Lock and unlock write plus at least one data transfer */
+    if (!i2c_fn_i2c || mmc_mailbox->comb_max_msgs < 4)
+        return 0;
+
+    mmc_mailbox->xfer.buf =
+        devm_kzalloc(dev, mmc_mailbox->byte_len + 3 * MMC_MB_XFER_MAX_MSGS, GFP_KERNEL);
+    if (!mmc_mailbox->xfer.buf)
+        return -ENOMEM;
+
+    mmc_mailbox->comb = true;
+
+    return 0;
+}
+
+static void mmc_mb_mmap_release(void* data)
+{
+    struct at24_data* mmc_mailbox = data;
+
+    /* Mappings keep their own references to the pages */
+    vfree(mmc_mailbox->mmap_hdr);
+}
+
+static int mmc_mb_init_mmap(struct at24_data* mmc_mailbox)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+
+    mmc_mailbox->mmap_hdr =
+        vmalloc_user(PAGE_ALIGN(sizeof(*mmc_mailbox->mmap_hdr) + mmc_mailbox->byte_len));
+    if (!mmc_mailbox->mmap_hdr)
+        return -ENOMEM;
+    mmc_mailbox->mmap_hdr->size = mmc_mailbox->byte_len;
+
+    return devm_add_action_or_reset(dev, mmc_mb_mmap_release, mmc_mailbox);
+}
+
+/* Optimistic reads need an MMC firmware with a "desy,generation-offset" */
+static int mmc_mb_init_generation(struct at24_data* mmc_mailbox)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    u32 offs;
+
+    if (device_property_read_u32(dev, "desy,generation-offset", &offs))
+        return 0;
+
+    if (offs >= mmc_mailbox->byte_len || offs == MB_LOCK_OFFS || offs == MB_FPGA_STATUS_OFFS) {
+        dev_err(dev, "invalid generation offset %u\n", offs);
+        return -EINVAL;
+    }
+
+    mmc_mailbox->gen_offs = offs;
+    mmc_mailbox->gen_valid = true;
+
+    return 0;
+}
+
+/*
+ * The MMC command byte is given by "desy,command-offset", what a shutdown
+ * request does by "desy,command-policy" (default "poweroff").
+ */
+static int mmc_mb_init_command(struct at24_data* mmc_mailbox)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    const char* policy;
+    u32 offs;
+    int ret;
+
+    if (device_property_read_u32(dev, "desy,command-offset", &offs))
+        return 0;
+
+    if (offs >= mmc_mailbox->byte_len || offs == MB_LOCK_OFFS || offs == MB_FPGA_STATUS_OFFS ||
+        (mmc_mailbox->gen_valid && offs == mmc_mailbox->gen_offs)) {
+        dev_err(dev, "invalid command offset %u\n", offs);
+        return -EINVAL;
+    }
+
+    mmc_mailbox->cmd_offs = offs;
+    mmc_mailbox->cmd_valid = true;
+    mmc_mailbox->cmd_policy = MMC_MB_CMD_POWEROFF;
+
+    if (device_property_read_string(dev, "desy,command-policy", &policy))
+        return 0;
+
+    ret = match_string(mmc_mb_cmd_names, ARRAY_SIZE(mmc_mb_cmd_names), policy);
+    if (ret < 0) {
+        dev_err(dev, "unknown command policy %s\n", policy);
+        return ret;
+    }
+    mmc_mailbox->cmd_policy = ret;
+
+    return 0;
+}
+
+/* The retry policy can be chosen with the "desy,retry-policy" property */
+static int mmc_mb_init_retry(struct at24_data* mmc_mailbox)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    const char* policy;
+    int ret;
+
+    mmc_mailbox->retry_policy = MMC_MB_RETRY_EXPONENTIAL;
+    mmc_mailbox->timeout_ms = at24_write_timeout;
+    mmc_mailbox->retry_min_us = MMC_MB_RETRY_MIN_US;
+    mmc_mailbox->retry_max_us = MMC_MB_RETRY_MAX_US;
+    mmc_mailbox->retry_learned_us = MMC_MB_RETRY_MIN_US;
+
+    if (device_property_read_string(dev, "desy,retry-policy", &policy))
+        return 0;
+
+    ret = match_string(mmc_mb_retry_names, ARRAY_SIZE(mmc_mb_retry_names), policy);
+    if (ret < 0) {
+        dev_err(dev, "unknown retry policy %s\n", policy);
+        return ret;
+    }
+    mmc_mailbox->retry_policy = ret;
+
+    return 0;
+}
+
+/* Largest write (data bytes) the adapter can do in one transfer */
+static unsigned int mmc_mb_adapter_write_max(struct i2c_client* client,
+                                             unsigned int byte_len,
+                                             bool i2c_fn_i2c,
+                                             bool i2c_fn_block)
+{
+    const struct i2c_adapter_quirks* quirks = client->adapter->quirks;
+
+    if (!i2c_fn_i2c)
+        return i2c_fn_block ? I2C_SMBUS_BLOCK_MAX : 1;
+
+    /* Two bytes of each write message are taken by the offset */
+    if (quirks && quirks->max_write_len > 2)
+        return min_t(unsigned int, quirks->max_write_len - 2, byte_len);
+    if (quirks && quirks->max_write_len)
+        return 1;
+
+    return byte_len;
+}
+
+/*
+ * Chunk sizing. The bus speed is estimated by timing a short and a long
+ * read; their difference is the time on the wire for the extra bytes,
+ * at 9 clocks per byte. Each transfer then gets as many bytes as fit into
+ * the bus hold budget, see mmc_mb_set_hold_budget().
+ */
+#define MMC_MB_CALIB_LEN 32
+#define MMC_MB_CALIB_RUNS 3
+
+/* Fastest of a few uncached reads of len bytes, in ns */
+static s64 mmc_mb_time_read(struct at24_data* mmc_mailbox, size_t len)
+{
+    s64 best = S64_MAX, t;
+    ktime_t start;
+    int i, ret;
+
+    for (i = 0; i < MMC_MB_CALIB_RUNS; i++) {
+        start = ktime_get();
+        ret = regmap_raw_read(mmc_mailbox->regmap, 0, mmc_mailbox->bounce, len);
+        t = ktime_to_ns(ktime_sub(ktime_get(), start));
+        if (ret) {
+            best = -1;
+            break;
+        }
+        best = min(best, t);
+    }
+
+    return best;
+}
+
+static void mmc_mb_init_chunks(struct at24_data* mmc_mailbox, bool i2c_fn_i2c, bool i2c_fn_block)
+{
+    const struct i2c_adapter_quirks* quirks = mmc_mailbox->client->adapter->quirks;
+    struct device* dev = &mmc_mailbox->client->dev;
+    unsigned int read_limit, write_limit, budget_us;
+
+    if (device_property_read_u32(dev, "desy,bus-hold-budget-us", &budget_us))
+        budget_us = MMC_MB_HOLD_BUDGET_US;
+
+    read_limit = i2c_fn_i2c ? mmc_mailbox->byte_len : I2C_SMBUS_BLOCK_MAX;
+    if (quirks && quirks->max_read_len)
+        read_limit = min_t(unsigned int, read_limit, quirks->max_read_len);
+    if (quirks && (quirks->flags & I2C_AQ_COMB) && quirks->max_comb_2nd_msg_len)
+        read_limit = min_t(unsigned int, read_limit, quirks->max_comb_2nd_msg_len);
+
+    write_limit = mmc_mailbox->page_size;
+    if (mmc_mailbox->ram_mode)
+        write_limit = mmc_mb_adapter_write_max(mmc_mailbox->client,
+                                               mmc_mailbox->byte_len,
+                                               i2c_fn_i2c,
+                                               i2c_fn_block);
+    if (!i2c_fn_i2c && write_limit > I2C_SMBUS_BLOCK_MAX)
+        write_limit = I2C_SMBUS_BLOCK_MAX;
+
+    mmc_mailbox->read_limit = read_limit;
+    mmc_mailbox->write_limit = write_limit;
+
+    /* Default chunk sizes until mmc_mb_calibrate() knows the bus speed */
+    mmc_mb_set_hold_budget(mmc_mailbox, budget_us);
+}
+
+/* Measure the bus speed and derive the chunk sizes from it, must hold lock */
+static void mmc_mb_calibrate(struct at24_data* mmc_mailbox)
+{
+    struct device* dev = &mmc_mailbox->client->dev;
+    unsigned int len = min_t(unsigned int, MMC_MB_CALIB_LEN, mmc_mailbox->read_limit);
+    s64 t_short, t_long, byte_ns = 0;
+
+    if (len > 1) {
+        t_short = mmc_mb_time_read(mmc_mailbox, 1);
+        t_long = mmc_mb_time_read(mmc_mailbox, len);
+        if (t_short > 0 && t_long > t_short)
+            byte_ns = div_s64(t_long - t_short, len - 1);
+    }
+    if (byte_ns <= 0)
+        dev_warn(dev, "bus speed calibration failed\n");
+    mmc_mailbox->byte_ns = max_t(s64, byte_ns, 0);
+
+    mmc_mb_set_hold_budget(mmc_mailbox, mmc_mailbox->hold_budget_us);
+}
+
+/*
+ * The first accesses to the chip, the bus speed calibration and a read of
+ * the whole mailbox, run in the background so that neither probe nor boot
+ * wait for a slow CPLD. The read fills the shadow (and thus the caches),
+ * and accesses wait until it is done.
+ * A chip that does not answer is only reported; accesses then fail or
+ * succeed on their own, like they would later on.
+ */
+static void mmc_mb_prefill_work(struct work_struct* work)
+{
+    struct at24_data* mmc_mailbox = container_of(work, struct at24_data, prefill_work);
+    struct device* dev = &mmc_mailbox->client->dev;
+    int ret;
+
+    ret = pm_runtime_get_sync(dev);
+    if (ret >= 0) {
+        mutex_lock(&mmc_mailbox->lock);
+        mmc_mb_calibrate(mmc_mailbox);
+        ret = mmc_mb_shadow_fill(mmc_mailbox, 0, mmc_mailbox->byte_len);
+        /* A request left over from before this boot is not acted upon */
+        if (!ret && mmc_mailbox->cmd_valid && !mmc_mailbox->cmd_known) {
+            mmc_mailbox->cmd_last = mmc_mailbox->shadow[mmc_mailbox->cmd_offs];
+            mmc_mailbox->cmd_known = true;
+        }
+        mutex_unlock(&mmc_mailbox->lock);
+        pm_runtime_put(dev);
+    } else {
+        pm_runtime_put_noidle(dev);
+    }
+
+    if (ret < 0)
+        dev_err(dev, "mailbox does not respond: %d\n", ret);
     else
-        cdata = NULL;
+        dev_info(dev,
+                 "%u byte %s EEPROM, %u bytes/write\n",
+                 mmc_mailbox->byte_len,
+                 mmc_mailbox->client->name,
+                 mmc_mailbox->write_max);
 
-    if (!cdata)
-        return ERR_PTR(-ENODEV);
+    complete_all(&mmc_mailbox->ready);
+}
 
-    return cdata;
+/* Registered before mmc_mb_flush_release(), so the final write-back can resume the device */
+static void mmc_mb_pm_release(void* data)
+{
+    struct device* dev = data;
+
+    pm_runtime_disable(dev);
+    pm_runtime_set_suspended(dev);
 }
 
 static int mmc_mailbox_probe(struct i2c_client* client)
@@ -379,7 +4255,6 @@ static int mmc_mailbox_probe(struct i2c_client* client)
     bool i2c_fn_i2c, i2c_fn_block;
     struct at24_data* mmc_mailbox;
     struct regmap* regmap;
-    u8 test_byte;
     int err;
 
     i2c_fn_i2c = i2c_check_functionality(client->adapter, I2C_FUNC_I2C);
@@ -408,27 +4283,83 @@ static int mmc_mailbox_probe(struct i2c_client* client)
     if (!is_power_of_2(page_size))
         dev_warn(dev, "page_size looks suspicious (no power of 2)!\n");
 
-    regmap_config.val_bits = 8;
-    regmap_config.reg_bits = 16;
-    regmap_config.disable_locking = true;
-
-    regmap = devm_regmap_init_i2c(client, &regmap_config);
-    if (IS_ERR(regmap))
-        return PTR_ERR(regmap);
-
-    mmc_mailbox = devm_kzalloc(dev, sizeof(mmc_mailbox), GFP_KERNEL);
+    /* Open files of the character device may keep it beyond unbinding */
+    mmc_mailbox = kzalloc(sizeof(*mmc_mailbox), GFP_KERNEL);
     if (!mmc_mailbox)
         return -ENOMEM;
+    kref_init(&mmc_mailbox->refs);
+    err = devm_add_action_or_reset(dev, mmc_mb_put, mmc_mailbox);
+    if (err)
+        return err;
 
     mutex_init(&mmc_mailbox->lock);
+    init_rwsem(&mmc_mailbox->unbind_sem);
+    spin_lock_init(&mmc_mailbox->reads_lock);
+    INIT_LIST_HEAD(&mmc_mailbox->reads);
+    init_waitqueue_head(&mmc_mailbox->doorbell_wq);
+    init_waitqueue_head(&mmc_mailbox->prio_wq);
+    INIT_LIST_HEAD(&mmc_mailbox->files);
     mmc_mailbox->byte_len = byte_len;
     mmc_mailbox->page_size = page_size;
+    mmc_mailbox->ram_mode = device_property_read_bool(dev, "desy,ram-mode");
     mmc_mailbox->client = client;
+
+    mmc_mailbox->shadow = devm_kzalloc(dev, byte_len, GFP_KERNEL);
+    mmc_mailbox->bounce = devm_kzalloc(dev, byte_len, GFP_KERNEL);
+    mmc_mailbox->shadow_known = devm_bitmap_zalloc(dev, byte_len, GFP_KERNEL);
+    mmc_mailbox->shadow_dirty = devm_bitmap_zalloc(dev, byte_len, GFP_KERNEL);
+    if (!mmc_mailbox->shadow || !mmc_mailbox->bounce || !mmc_mailbox->shadow_known ||
+        !mmc_mailbox->shadow_dirty)
+        return -ENOMEM;
+
+    err = mmc_mb_init_mmap(mmc_mailbox);
+    if (err)
+        return err;
+
+    err = mmc_mb_init_retry(mmc_mailbox);
+    if (err)
+        return err;
+
+    INIT_DELAYED_WORK(&mmc_mailbox->flush_work, mmc_mb_flush_work);
+    INIT_WORK(&mmc_mailbox->prefill_work, mmc_mb_prefill_work);
+    init_completion(&mmc_mailbox->ready);
+    device_property_read_u32(dev, "desy,writeback-ms", &mmc_mailbox->writeback_ms);
+    device_property_read_u32(dev, "desy,snapshot-ms", &mmc_mailbox->snapshot_ms);
+    device_property_read_u32(dev, "desy,lock-budget-us", &mmc_mailbox->lock_budget_us);
+
+    err = mmc_mb_init_generation(mmc_mailbox);
+    if (err)
+        return err;
+
+    err = mmc_mb_init_command(mmc_mailbox);
+    if (err)
+        return err;
+
+    err = mmc_mb_get_regions(mmc_mailbox, cdata);
+    if (err)
+        return err;
+
+    /* The regmap access callbacks look up the region table */
+    i2c_set_clientdata(client, mmc_mailbox);
+
+    regmap_config.val_bits = 8;
+    regmap_config.reg_bits = 16;
+    regmap_config.disable_locking = true;
+    regmap_config.max_register = byte_len - 1;
+    regmap_config.readable_reg = mmc_mb_readable_reg;
+    regmap_config.writeable_reg = mmc_mb_writeable_reg;
+    regmap_config.precious_reg = mmc_mb_precious_reg;
+
+    regmap = devm_regmap_init_i2c(client, &regmap_config);
+    if (IS_ERR(regmap))
+        return PTR_ERR(regmap);
     mmc_mailbox->regmap = regmap;
 
-    mmc_mailbox->write_max = min_t(unsigned int, page_size, mmc_mailbox_io_limit);
-    if (!i2c_fn_i2c && mmc_mailbox->write_max > I2C_SMBUS_BLOCK_MAX)
-        mmc_mailbox->write_max = I2C_SMBUS_BLOCK_MAX;
+    mmc_mb_init_chunks(mmc_mailbox, i2c_fn_i2c, i2c_fn_block);
+
+    err = mmc_mb_init_comb(mmc_mailbox, i2c_fn_i2c);
+    if (err)
+        return err;
 
     nvmem_config.name = dev_name(dev);
     nvmem_config.dev = dev;
@@ -444,52 +4375,68 @@ static int mmc_mailbox_probe(struct i2c_client* client)
     nvmem_config.word_size = 1;
     nvmem_config.size = byte_len;
 
+    /* Registered before the nvmem device, so its readers are gone by then */
+    err = devm_add_action_or_reset(dev, mmc_mb_snapshot_release, mmc_mailbox);
+    if (err)
+        return err;
+
+    /* enable runtime pm */
+    pm_runtime_set_active(dev);
+    pm_runtime_enable(dev);
+    err = devm_add_action_or_reset(dev, mmc_mb_pm_release, dev);
+    if (err)
+        return err;
+
+    err = devm_add_action_or_reset(dev, mmc_mb_flush_release, mmc_mailbox);
+    if (err)
+        return err;
+
     mmc_mailbox->nvmem = devm_nvmem_register(dev, &nvmem_config);
     if (IS_ERR(mmc_mailbox->nvmem))
         return PTR_ERR(mmc_mailbox->nvmem);
 
-    i2c_set_clientdata(client, mmc_mailbox);
+    err = mmc_mb_misc_register(mmc_mailbox);
+    if (err)
+        return err;
 
-    /* enable runtime pm */
-    pm_runtime_set_active(dev);
-    pm_runtime_enable(dev);
+    err = mmc_mb_init_doorbell(mmc_mailbox);
+    if (err)
+        return err;
 
-    /*
-   * Perform a one-byte test read to verify that the
-   * chip is functional.
-   */
-    err = at24_read(mmc_mailbox, 0, &test_byte, 1);
-    pm_runtime_idle(dev);
-    if (err) {
-        pm_runtime_disable(dev);
-        return -ENODEV;
-    }
+    err = mmc_mb_init_poll(mmc_mailbox);
+    if (err)
+        return err;
 
-    dev_info(dev,
-             "%u byte %s EEPROM, %u bytes/write\n",
-             byte_len,
-             client->name,
-             mmc_mailbox->write_max);
+    err = mmc_mb_init_pwroff(mmc_mailbox);
+    if (err)
+        return err;
 
-    /* If a pm_power_off function has already been added, leave it alone */
-    if (pm_power_off != NULL) {
-        dev_err(dev, "pm_power_off function already registered\n");
-        return 0;
-    }
-    mmc_mb_pwroff_inst = mmc_mailbox;
-    pm_power_off = &mmc_mailbox_do_poweroff;
+    schedule_work(&mmc_mailbox->prefill_work);
 
     return 0;
 }
 
+/*
+ * Pending write-back data has to reach the MMC before power goes away, and
+ * the poller has to stay away from the bus from then on.
+ */
+static void mmc_mailbox_shutdown(struct i2c_client* client)
+{
+    struct at24_data* mmc_mailbox = i2c_get_clientdata(client);
+
+    flush_work(&mmc_mailbox->prefill_work);
+    mmc_mb_poll_stop(mmc_mailbox);
+    cancel_delayed_work_sync(&mmc_mailbox->flush_work);
+    if (mmc_mb_flush(mmc_mailbox))
+        dev_err(&client->dev, "failed to write back pending data\n");
+}
+
+/* The rest, including the final write-back and runtime PM, is left to devm */
 static int mmc_mailbox_remove(struct i2c_client* client)
 {
-    pm_runtime_disable(&client->dev);
-    pm_runtime_set_suspended(&client->dev);
+    struct at24_data* mmc_mailbox = i2c_get_clientdata(client);
 
-    if (pm_power_off == &mmc_mailbox_do_poweroff) {
-        pm_power_off = NULL;
-    }
+    flush_work(&mmc_mailbox->prefill_work);
 
     return 0;
 }
@@ -499,20 +4446,19 @@ static struct i2c_driver mmc_mailbox_driver = {
         {
             .name = "mmc_mailbox",
             .of_match_table = mmc_mailbox_of_match,
+            .dev_groups = mmc_mb_groups,
+            .probe_type = PROBE_PREFER_ASYNCHRONOUS,
         },
     .probe_new = mmc_mailbox_probe,
     .remove = mmc_mailbox_remove,
+    .shutdown = mmc_mailbox_shutdown,
     .id_table = mmc_mailbox_ids,
 };
 
 static int __init mmc_mailbox_init(void)
 {
-    if (!mmc_mailbox_io_limit) {
-        pr_err("mmc_mailbox: mmc_mailbox_io_limit must not be 0!\n");
-        return -EINVAL;
-    }
-
-    mmc_mailbox_io_limit = rounddown_pow_of_two(mmc_mailbox_io_limit);
+    if (mmc_mailbox_io_limit)
+        mmc_mailbox_io_limit = rounddown_pow_of_two(mmc_mailbox_io_limit);
     return i2c_add_driver(&mmc_mailbox_driver);
 }
 module_init(mmc_mailbox_init);
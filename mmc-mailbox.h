@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: GPL-2.0+ WITH Linux-syscall-note */
+/*
+ * Userspace interface of the DMMC-STAMP Mailbox driver (/dev/mmc-mailboxN)
+ *
+ * Copyright (C) 2022 Patrick Huesmann, DESY
+ */
+
+#ifndef _MMC_MAILBOX_H
+#define _MMC_MAILBOX_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MMC_MB_IOC_MAGIC 0xb7
+
+/* One read or write of a batch, buf is a user pointer */
+struct mmc_mb_seg {
+    __u32 offset;
+    __u32 len;
+    __u32 flags;
+    __u32 reserved;
+    __u64 buf;
+};
+
+#define MMC_MB_SEG_WRITE 0x1
+
+/*
+ * All segments of a batch are executed in order within one mailbox lock
+ * session, so the MMC can't swap its page in between.
+ */
+struct mmc_mb_batch {
+    __u64 segs;
+    __u32 num_segs;
+    __u32 flags;
+};
+
+#define MMC_MB_BATCH_MAX_SEGS 64
+
+#define MMC_MB_IOC_BATCH _IOW(MMC_MB_IOC_MAGIC, 0x01, struct mmc_mb_batch)
+
+struct mmc_mb_range {
+    __u32 offset;
+    __u32 len;
+};
+
+/*
+ * Byte ranges watched by a file descriptor, ranges is a user pointer. The
+ * file becomes readable (POLLIN) when data in one of them changes, until
+ * the next read(). A new call replaces the previous ranges.
+ */
+struct mmc_mb_watch {
+    __u64 ranges;
+    __u32 num_ranges;
+    __u32 flags;
+};
+
+#define MMC_MB_WATCH_MAX_RANGES 16
+
+#define MMC_MB_IOC_WATCH _IOW(MMC_MB_IOC_MAGIC, 0x02, struct mmc_mb_watch)
+
+/*
+ * io_uring passthrough (IORING_OP_URING_CMD): the command area of the SQE
+ * holds a struct mmc_mb_uring_cmd and cmd_op selects the operation. For
+ * READ and WRITE, addr is the buffer and len its size in bytes; for BATCH,
+ * addr points to len struct mmc_mb_seg executed like MMC_MB_IOC_BATCH and
+ * offset must be 0. Commands to one device run in submission order. The
+ * result is the number of bytes transferred or a negative error code.
+ */
+struct mmc_mb_uring_cmd {
+    __u64 addr;
+    __u32 offset;
+    __u32 len;
+};
+
+#define MMC_MB_URING_CMD_READ 0x01
+#define MMC_MB_URING_CMD_WRITE 0x02
+#define MMC_MB_URING_CMD_BATCH 0x03
+
+/*
+ * Header of the read-only mmap() of /dev/mmc-mailboxN, followed by size
+ * bytes of mailbox content. seq is odd while the driver updates the page,
+ * so readers retry like with a seqcount:
+ *
+ *	do {
+ *		seq = hdr->seq;
+ *		rmb();
+ *		memcpy(buf, (char *)(hdr + 1) + offset, len);
+ *		rmb();
+ *	} while ((seq & 1) || seq != hdr->seq);
+ *
+ * stamp_ns is the CLOCK_MONOTONIC time the last bus read started.
+ */
+struct mmc_mb_mmap_hdr {
+    __u32 seq;
+    __u32 size;
+    __u64 stamp_ns;
+    __u64 reserved[6];
+};
+
+#endif /* _MMC_MAILBOX_H */